@@ -10,15 +10,12 @@
 
 extern ReporterInterface *gReporter;
 
-CAddrSeed *CAddrSeed::mInstance = nullptr;
-
-void CAddrSeed::addNewAddr(const CService &addr)
+bool CAddrSeed::addNewAddr(const CService &addr)
 {
     std::lock_guard<std::mutex> lock(mSeedLock);
-    auto pair = mSeenAddr.insert(addr);
     // duplicate address
-    if (!pair.second) {
-        return;
+    if (!mSeenAddr.insert(addr)) {
+        return false;
     }
     if (gReporter != nullptr) {
         gReporter->reportNewAddr(addr.ToStringIP(), addr.GetPort());
@@ -27,15 +24,69 @@ void CAddrSeed::addNewAddr(const CService &addr)
     if (mSeedAddr.empty()) {
         need_notify = true;
     }
-    mSeedAddr.push_back(&(*pair.first));
+    mSeedAddr.push_back(addr);
 
     if (need_notify) {
-        mCond.notify_one();
+        // several idle shards may be waiting for addresses
+        mCond.notify_all();
+    }
+    return true;
+}
+
+size_t CAddrSeed::addNewAddrs(const CService *addrs, size_t n)
+{
+    std::lock_guard<std::mutex> lock(mSeedLock);
+    bool need_notify = mSeedAddr.empty();
+    size_t nNew = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const CService &addr = addrs[i];
+        if (!mSeenAddr.insert(addr)) {
+            continue;
+        }
+        if (gReporter != nullptr) {
+            gReporter->reportNewAddr(addr.ToStringIP(), addr.GetPort());
+        }
+        nNew++;
+        // Tor, I2P and CJDNS peers are recorded but not connected to
+        if (addr.IsIP()) {
+            mSeedAddr.push_back(addr);
+        }
     }
+    if (need_notify && !mSeedAddr.empty()) {
+        mCond.notify_all();
+    }
+    return nNew;
 }
 
+void CAddrSeed::addTimeoutAddr(const CService &addr)
+{
+    std::lock_guard<std::mutex> lock(mSeedLock);
+    if (mSeenAddr.contains(addr)) {
+        mTimeoutAddr.push_back(addr);
+        if (mTimeoutAddr.size() > MAX_FAILED_ADDRS) {
+            mTimeoutAddr.pop_front();
+        }
+    }
+}
+
+void CAddrSeed::addRefusedAddr(const CService &addr)
+{
+    std::lock_guard<std::mutex> lock(mSeedLock);
+    if (mSeenAddr.contains(addr)) {
+        mRefusedAddr.push_back(addr);
+        if (mRefusedAddr.size() > MAX_FAILED_ADDRS) {
+            mRefusedAddr.pop_front();
+        }
+    }
+}
+
+size_t CAddrSeed::pendingCount()
+{
+    std::lock_guard<std::mutex> lock(mSeedLock);
+    return mSeedAddr.size();
+}
 
-bool CAddrSeed::getNewAddrs(std::vector<CService *> &addrs, size_t &size, bool wait) {
+bool CAddrSeed::getNewAddrs(std::vector<CService> &addrs, size_t &size, bool wait) {
     std::unique_lock<std::mutex> lock(mSeedLock);
 
 
@@ -44,17 +95,18 @@ bool CAddrSeed::getNewAddrs(std::vector<CService *> &addrs, size_t &size, bool w
     }
 
     if (mSeedAddr.empty()) {
-        size = 0;
         if (wait) {
+            // addresses now arrive from other threads, e.g. the dns seeder
             mCond.wait(lock, [this] { return !mSeedAddr.empty(); });
         } else {
+            size = 0;
             return false;
         }
     }
 
     size = std::min(size, mSeedAddr.size());
     for (auto i = 0; i < size; ++i) {
-        addrs.push_back(const_cast<CService *>(mSeedAddr.front()));
+        addrs.push_back(mSeedAddr.front());
         mSeedAddr.pop_front();
     }
 
@@ -71,7 +123,7 @@ int main(void)
     printf("addr: %s\n", addr.ToString().c_str());
     addrSeed.addNewAddr(addr);
 
-    std::vector<CService *> vAddrs;
+    std::vector<CService> vAddrs;
     size_t size = 2;
     addrSeed.getNewAddrs(vAddrs, size, false);
     for (auto paddr: vAddrs) {
@@ -1,39 +1,47 @@
 #ifndef __ADDRSET_H__
 #define __ADDRSET_H__
 
+#include "serviceset.h"
+
 #include <bitcoin/protocol.h>
 
-#include <set>
 #include <deque>
 #include <mutex>
 #include <condition_variable>
 
-static std::mutex instanceLock;
+// most recent failed addresses remembered of each kind, older ones are dropped
+static const size_t MAX_FAILED_ADDRS = 4096;
+
 class CAddrSeed
 {
 public:
     CAddrSeed(const CAddrSeed &) = delete;
     CAddrSeed& operator=(const CAddrSeed &) = delete;
+    // the dns thread and every shard may get here first, a function-local
+    // static is initialized exactly once whoever does
     static CAddrSeed &getInstance() {
-        if (mInstance == nullptr) {
-            std::lock_guard<std::mutex> lock(instanceLock);
-            mInstance = new CAddrSeed;
-        }
-        return *mInstance;
+        static CAddrSeed instance;
+        return instance;
     }
-    void addNewAddr(const CService &addr);
-    bool getNewAddrs(std::vector<CService *> &addrs, size_t &size, bool wait=false);
+    // false when the address was already known
+    bool addNewAddr(const CService &addr);
+    // a whole addr message under one lock, returns how many were new
+    size_t addNewAddrs(const CService *addrs, size_t n);
+    bool getNewAddrs(std::vector<CService> &addrs, size_t &size, bool wait=false);
+    void addTimeoutAddr(const CService &addr);
+    void addRefusedAddr(const CService &addr);
+    // addresses queued and not yet handed out
+    size_t pendingCount();
 
 private:
-    CAddrSeed() = default;    
-    static CAddrSeed *mInstance;
+    CAddrSeed() = default;
 
     std::condition_variable mCond;
     std::mutex mSeedLock;
-    std::deque<const CService *> mSeedAddr;
-    std::set<CService> mSeenAddr;
-    std::vector<const CService *> mTimeoutAddr;
-    std::vector<const CService *> mRefusedAddr;
+    std::deque<CService> mSeedAddr;
+    ServiceSet mSeenAddr;
+    std::deque<CService> mTimeoutAddr;
+    std::deque<CService> mRefusedAddr;
 };
 
 #endif
@@ -0,0 +1,117 @@
+#include "connrate.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+static const double CONNECT_WINDOW_INIT = 16;
+static const double CONNECT_WINDOW_MIN = 4;
+static const double CONNECT_WINDOW_MAX = 4096;
+static const double CONNECT_WINDOW_STEP = 4;
+static const double CONNECT_RATE_INIT = 50;
+static const double CONNECT_RATE_MIN = 5;
+static const double CONNECT_RATE_MAX = 10000;
+static const double CONNECT_RATE_STEP = 10;
+static const double CONNECT_DECREASE = 0.5;
+
+static const uint64_t CONNECT_EPOCH_MS = 1000;
+// outcomes an epoch needs before it counts
+static const uint32_t CONNECT_EPOCH_MIN_SAMPLES = 8;
+// failure ratio above the long-term average that counts as congestion
+static const double CONNECT_FAILURE_MARGIN = 0.15;
+static const double CONNECT_FAILURE_EWMA = 0.125;
+// latency above this multiple of the fastest epoch counts as congestion
+static const uint64_t CONNECT_LATENCY_FACTOR = 3;
+static const uint64_t CONNECT_LATENCY_SLACK_MS = 50;
+
+ConnectController::ConnectController(uint64_t nowMs):
+    mWindow(CONNECT_WINDOW_INIT), mRate(CONNECT_RATE_INIT), mTokens(CONNECT_RATE_INIT / 10),
+    mLastRefill(nowMs), mEpochStart(nowMs), nSuccess(0), nFailure(0), mLatencySum(0), mLimited(false),
+    mFailureAvg(-1), mMinLatency(0)
+{
+}
+
+void ConnectController::refill(uint64_t nowMs)
+{
+    if (nowMs <= mLastRefill) {
+        return;
+    }
+    // allow a burst of at most 100ms worth of connects
+    mTokens = std::min(mTokens + mRate * (nowMs - mLastRefill) / 1000, std::max(mRate / 10, 1.0));
+    mLastRefill = nowMs;
+}
+
+size_t ConnectController::allowance(uint64_t nowMs, size_t inFlight)
+{
+    refill(nowMs);
+    if (nowMs >= mEpochStart + CONNECT_EPOCH_MS) {
+        endEpoch(nowMs);
+    }
+    size_t window = static_cast<size_t>(mWindow);
+    if (inFlight >= window) {
+        return 0;
+    }
+    return std::min(window - inFlight, static_cast<size_t>(mTokens));
+}
+
+int ConnectController::waitMs() const
+{
+    if (mTokens >= 1) {
+        return -1;
+    }
+    return static_cast<int>((1 - mTokens) * 1000 / mRate) + 1;
+}
+
+void ConnectController::onAttempt()
+{
+    mTokens -= 1;
+}
+
+void ConnectController::onConnected(uint64_t latencyMs)
+{
+    nSuccess++;
+    mLatencySum += latencyMs;
+}
+
+void ConnectController::onFailure()
+{
+    nFailure++;
+}
+
+void ConnectController::endEpoch(uint64_t nowMs)
+{
+    uint32_t total = nSuccess + nFailure;
+    if (total < CONNECT_EPOCH_MIN_SAMPLES) {
+        // too little to judge, keep collecting
+        return;
+    }
+    double failure = static_cast<double>(nFailure) / total;
+    uint64_t latency = nSuccess > 0 ? mLatencySum / nSuccess : 0;
+    if (mFailureAvg < 0) {
+        mFailureAvg = failure;
+    }
+    if (nSuccess > 0 && (mMinLatency == 0 || latency < mMinLatency)) {
+        mMinLatency = std::max<uint64_t>(latency, 1);
+    }
+
+    bool congested = failure > mFailureAvg + CONNECT_FAILURE_MARGIN;
+    if (nSuccess > 0 && latency > mMinLatency * CONNECT_LATENCY_FACTOR
+            && latency > mMinLatency + CONNECT_LATENCY_SLACK_MS) {
+        congested = true;
+    }
+    if (congested) {
+        mWindow = std::max(mWindow * CONNECT_DECREASE, CONNECT_WINDOW_MIN);
+        mRate = std::max(mRate * CONNECT_DECREASE, CONNECT_RATE_MIN);
+        printf("connect congestion: failure %.2f (avg %.2f), latency %lums (min %lums), window=%.0f rate=%.0f/s\n",
+            failure, mFailureAvg, latency, mMinLatency, mWindow, mRate);
+    } else if (mLimited) {
+        // only probe for more when the limits were actually in the way
+        mWindow = std::min(mWindow + CONNECT_WINDOW_STEP, CONNECT_WINDOW_MAX);
+        mRate = std::min(mRate + CONNECT_RATE_STEP, CONNECT_RATE_MAX);
+    }
+    mFailureAvg += CONNECT_FAILURE_EWMA * (failure - mFailureAvg);
+
+    mEpochStart = nowMs;
+    nSuccess = nFailure = 0;
+    mLatencySum = 0;
+    mLimited = false;
+}
@@ -0,0 +1,60 @@
+#ifndef __CONNRATE_H__
+#define __CONNRATE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * AIMD controller for outgoing connects. It bounds both the number of
+ * connects in flight (window) and how fast new ones are started (rate,
+ * enforced with a token bucket). Outcomes are collected per epoch; while
+ * the failure ratio stays near its long-term average and connect latency
+ * near the fastest seen, both limits grow additively, and they are halved
+ * as soon as failures or latency climb, i.e. when we are the ones causing
+ * the SYNs to get dropped.
+ */
+class ConnectController
+{
+public:
+    explicit ConnectController(uint64_t nowMs);
+
+    // how many connects may be started now, given those still in flight
+    size_t allowance(uint64_t nowMs, size_t inFlight);
+    // ms until allowance may become non-zero again, -1 if not token-bound
+    int waitMs() const;
+    void onAttempt();
+    // the allowance, not the supply of addresses, bounded this round
+    void onLimited() {
+        mLimited = true;
+    }
+    void onConnected(uint64_t latencyMs);
+    // refused, unreachable or timed out
+    void onFailure();
+
+    size_t window() const {
+        return static_cast<size_t>(mWindow);
+    }
+    double rate() const {
+        return mRate;
+    }
+
+private:
+    void refill(uint64_t nowMs);
+    void endEpoch(uint64_t nowMs);
+
+    double mWindow;
+    double mRate;           // connects per second
+    double mTokens;
+    uint64_t mLastRefill;
+
+    uint64_t mEpochStart;
+    uint32_t nSuccess;
+    uint32_t nFailure;
+    uint64_t mLatencySum;
+    bool mLimited;
+
+    double mFailureAvg;     // long-term failure ratio, <0 until measured
+    uint64_t mMinLatency;
+};
+
+#endif
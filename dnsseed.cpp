@@ -0,0 +1,342 @@
+#include "dnsseed.h"
+#include "addrseed.h"
+#include "timer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <fstream>
+#include <random>
+
+static const uint16_t DNS_TYPE_A = 1;
+static const uint16_t DNS_TYPE_AAAA = 28;
+static const uint16_t DNS_CLASS_IN = 1;
+static const size_t DNS_HEADER_SIZE = 12;
+static const size_t DNS_MAX_PACKET = 4096;
+// poll interval while idle, to notice the address queue running low
+static const int DNS_IDLE_POLL_MS = 1000;
+
+static uint16_t readU16(const unsigned char *p)
+{
+    return static_cast<uint16_t>(p[0] << 8 | p[1]);
+}
+
+static void writeU16(unsigned char *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+// skip a possibly compressed name, returns the offset behind it or 0
+static size_t skipName(const unsigned char *buf, size_t len, size_t pos)
+{
+    while (pos < len) {
+        unsigned char l = buf[pos];
+        if (l == 0) {
+            return pos + 1;
+        }
+        if ((l & 0xc0) == 0xc0) {
+            // a pointer ends the name
+            return pos + 2 <= len ? pos + 2 : 0;
+        }
+        if ((l & 0xc0) != 0) {
+            return 0;
+        }
+        pos += 1 + l;
+    }
+    return 0;
+}
+
+DNSSeeder::DNSSeeder(const std::vector<std::string> &seeds, const CService &_server):
+    server(_server), sock(-1), nPending(0), lastRound(0), stopping(false)
+{
+    std::random_device rd;
+    nextId = static_cast<uint16_t>(rd());
+    for (auto &seed: seeds) {
+        for (auto type: {DNS_TYPE_A, DNS_TYPE_AAAA}) {
+            Query query;
+            query.name = seed;
+            query.type = type;
+            query.id = 0;
+            query.tries = 0;
+            query.deadline = 0;
+            query.pending = false;
+            queries.push_back(query);
+        }
+    }
+}
+
+DNSSeeder::~DNSSeeder()
+{
+    if (sock >= 0) {
+        close(sock);
+    }
+}
+
+bool DNSSeeder::init()
+{
+    if (!openSocket()) {
+        printf("dns seeder: cannot reach nameserver %s: %s\n", server.ToString().c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+std::thread DNSSeeder::runThread()
+{
+    return std::thread(&DNSSeeder::seederThread, this);
+}
+
+bool DNSSeeder::defaultServer(CService &server)
+{
+    std::ifstream conf("/etc/resolv.conf");
+    std::string line;
+    while (std::getline(conf, line)) {
+        if (line.compare(0, 10, "nameserver") != 0) {
+            continue;
+        }
+        size_t begin = line.find_first_not_of(" \t", 10);
+        if (begin == std::string::npos) {
+            continue;
+        }
+        size_t end = line.find_first_of(" \t", begin);
+        if (parseServer(line.substr(begin, end - begin), server)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool DNSSeeder::parseServer(const std::string &str, CService &server)
+{
+    std::string host = str;
+    uint16_t port = 53;
+    if (!host.empty() && host[0] == '[') {
+        size_t close = host.find(']');
+        if (close == std::string::npos) {
+            return false;
+        }
+        if (close + 1 < host.size()) {
+            if (host[close + 1] != ':') {
+                return false;
+            }
+            port = atoi(host.c_str() + close + 2);
+        }
+        host = host.substr(1, close - 1);
+    } else if (host.find(':') == host.rfind(':') && host.find(':') != std::string::npos) {
+        // exactly one colon: IPv4 with a port
+        port = atoi(host.c_str() + host.find(':') + 1);
+        host = host.substr(0, host.find(':'));
+    }
+    struct in_addr inAddr;
+    struct in6_addr in6Addr;
+    if (inet_pton(AF_INET, host.c_str(), &inAddr) == 1) {
+        server = CService(inAddr, port);
+    } else if (inet_pton(AF_INET6, host.c_str(), &in6Addr) == 1) {
+        server = CService(in6Addr, port);
+    } else {
+        return false;
+    }
+    return port != 0;
+}
+
+bool DNSSeeder::openSocket()
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (!server.GetSockAddr(reinterpret_cast<struct sockaddr *>(&addr), &addrlen)) {
+        return false;
+    }
+    sock = socket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        return false;
+    }
+    // connected, so the kernel drops datagrams from anyone but the server
+    if (connect(sock, reinterpret_cast<struct sockaddr *>(&addr), addrlen) < 0) {
+        close(sock);
+        sock = -1;
+        return false;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    return true;
+}
+
+void DNSSeeder::startRound(uint64_t now)
+{
+    lastRound = now;
+    for (auto &query: queries) {
+        query.tries = 0;
+        query.pending = true;
+        nPending++;
+        sendQuery(query, now);
+    }
+}
+
+void DNSSeeder::sendQuery(Query &query, uint64_t now)
+{
+    unsigned char buf[DNS_MAX_PACKET];
+    query.id = nextId++;
+    query.tries++;
+    query.deadline = now + DNS_QUERY_TIMEOUT_MS;
+
+    memset(buf, 0, DNS_HEADER_SIZE);
+    writeU16(buf, query.id);
+    writeU16(buf + 2, 0x0100);   // standard query, recursion desired
+    writeU16(buf + 4, 1);        // one question
+    size_t pos = DNS_HEADER_SIZE;
+    size_t begin = 0;
+    const std::string &name = query.name;
+    while (begin < name.size()) {
+        size_t dot = name.find('.', begin);
+        if (dot == std::string::npos) {
+            dot = name.size();
+        }
+        size_t label = dot - begin;
+        if (label == 0 || label > 63 || pos + label + 1 + 5 > sizeof(buf)) {
+            printf("invalid dns seed name %s\n", name.c_str());
+            query.tries = DNS_QUERY_TRIES;
+            return;
+        }
+        buf[pos++] = static_cast<unsigned char>(label);
+        memcpy(buf + pos, name.data() + begin, label);
+        pos += label;
+        begin = dot + 1;
+    }
+    buf[pos++] = 0;
+    writeU16(buf + pos, query.type);
+    writeU16(buf + pos + 2, DNS_CLASS_IN);
+    pos += 4;
+
+    if (send(sock, buf, pos, 0) < 0) {
+        printf("dns query for %s failed: %s\n", name.c_str(), strerror(errno));
+    }
+}
+
+void DNSSeeder::retryQueries(uint64_t now)
+{
+    for (auto &query: queries) {
+        if (!query.pending || query.deadline > now) {
+            continue;
+        }
+        if (query.tries >= DNS_QUERY_TRIES) {
+            printf("dns query for %s (type %u) timed out\n", query.name.c_str(), query.type);
+            query.pending = false;
+            nPending--;
+            continue;
+        }
+        sendQuery(query, now);
+    }
+}
+
+void DNSSeeder::handleResponse(const unsigned char *buf, size_t len)
+{
+    if (len < DNS_HEADER_SIZE) {
+        return;
+    }
+    uint16_t id = readU16(buf);
+    uint16_t flags = readU16(buf + 2);
+    uint16_t qdcount = readU16(buf + 4);
+    uint16_t ancount = readU16(buf + 6);
+    Query *query = nullptr;
+    for (auto &q: queries) {
+        if (q.pending && q.id == id) {
+            query = &q;
+            break;
+        }
+    }
+    if (query == nullptr || (flags & 0x8000) == 0) {
+        // stale answer to a query we already retried, or not an answer
+        return;
+    }
+    query->pending = false;
+    nPending--;
+    if ((flags & 0x000f) != 0) {
+        printf("dns query for %s (type %u) failed, rcode %u\n", query->name.c_str(), query->type, flags & 0x000f);
+        return;
+    }
+
+    size_t pos = DNS_HEADER_SIZE;
+    for (auto i = 0; i < qdcount && pos != 0; ++i) {
+        pos = skipName(buf, len, pos);
+        if (pos != 0) {
+            pos += 4;
+        }
+    }
+    size_t nAddrs = 0;
+    for (auto i = 0; i < ancount && pos != 0; ++i) {
+        pos = skipName(buf, len, pos);
+        if (pos == 0 || pos + 10 > len) {
+            break;
+        }
+        uint16_t type = readU16(buf + pos);
+        uint16_t cls = readU16(buf + pos + 2);
+        uint16_t rdlength = readU16(buf + pos + 8);
+        pos += 10;
+        if (pos + rdlength > len) {
+            break;
+        }
+        if (cls == DNS_CLASS_IN && type == DNS_TYPE_A && rdlength == 4) {
+            struct in_addr inAddr;
+            memcpy(&inAddr, buf + pos, 4);
+            CAddrSeed::getInstance().addNewAddr(CService(inAddr, DNS_SEED_PORT));
+            nAddrs++;
+        } else if (cls == DNS_CLASS_IN && type == DNS_TYPE_AAAA && rdlength == 16) {
+            struct in6_addr in6Addr;
+            memcpy(&in6Addr, buf + pos, 16);
+            CAddrSeed::getInstance().addNewAddr(CService(in6Addr, DNS_SEED_PORT));
+            nAddrs++;
+        }
+        pos += rdlength;
+    }
+    printf("dns seed %s (type %u): %zu addresses\n", query->name.c_str(), query->type, nAddrs);
+}
+
+int DNSSeeder::nextTimeoutMs(uint64_t now) const
+{
+    int timeout = DNS_IDLE_POLL_MS;
+    for (auto &query: queries) {
+        if (!query.pending) {
+            continue;
+        }
+        int left = query.deadline > now ? static_cast<int>(query.deadline - now) : 0;
+        timeout = std::min(timeout, left);
+    }
+    return timeout;
+}
+
+void DNSSeeder::seederThread()
+{
+    unsigned char buf[DNS_MAX_PACKET];
+    startRound(monotonicMs());
+    while (!stopping) {
+        uint64_t now = monotonicMs();
+        if (nPending == 0 && now >= lastRound + DNS_RESEED_INTERVAL_MS
+                && CAddrSeed::getInstance().pendingCount() < DNS_RESEED_LOW_WATER) {
+            printf("address queue low, reseeding from dns\n");
+            startRound(now);
+        }
+
+        struct pollfd pfd;
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        int ret = poll(&pfd, 1, nextTimeoutMs(now));
+        if (ret < 0 && errno != EINTR) {
+            printf("dns seeder poll error: %s\n", strerror(errno));
+            return;
+        }
+        while (ret > 0) {
+            ssize_t n = recv(sock, buf, sizeof(buf), 0);
+            if (n < 0) {
+                // EAGAIN, or an ICMP error from the last send
+                break;
+            }
+            handleResponse(buf, n);
+        }
+        retryQueries(monotonicMs());
+    }
+}
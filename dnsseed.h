@@ -0,0 +1,73 @@
+#ifndef __DNSSEED_H__
+#define __DNSSEED_H__
+
+#include <bitcoin/protocol.h>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+// default port of the addresses a DNS seed hands out
+static const uint16_t DNS_SEED_PORT = 8333;
+// reseed once fewer addresses than this are waiting to be connected
+static const size_t DNS_RESEED_LOW_WATER = 1000;
+static const uint64_t DNS_RESEED_INTERVAL_MS = 60 * 1000;
+static const uint64_t DNS_QUERY_TIMEOUT_MS = 2000;
+static const int DNS_QUERY_TRIES = 3;
+
+/*
+ * Resolves all DNS seeds at once over a single UDP socket on its own
+ * thread. A and AAAA queries for every seed go out together and each
+ * answer is handed to CAddrSeed as soon as it arrives. Once a round has
+ * finished, the seeds are queried again whenever the address queue runs
+ * low, but no more often than DNS_RESEED_INTERVAL_MS.
+ */
+class DNSSeeder
+{
+public:
+    DNSSeeder(const std::vector<std::string> &seeds, const CService &server);
+    DNSSeeder(const DNSSeeder &) = delete;
+    DNSSeeder &operator=(const DNSSeeder &) = delete;
+    ~DNSSeeder();
+    // open the socket to the nameserver, false when it cannot be used
+    bool init();
+    std::thread runThread();
+    // ask the seeder thread to return, it notices within DNS_IDLE_POLL_MS
+    void stop() {
+        stopping = true;
+    }
+
+    // first nameserver of /etc/resolv.conf
+    static bool defaultServer(CService &server);
+    // "1.2.3.4", "1.2.3.4:53", "::1" or "[::1]:53"
+    static bool parseServer(const std::string &str, CService &server);
+
+private:
+    struct Query {
+        std::string name;
+        uint16_t type;
+        uint16_t id;
+        int tries;
+        uint64_t deadline;
+        bool pending;
+    };
+    void seederThread();
+    bool openSocket();
+    void startRound(uint64_t now);
+    void sendQuery(Query &query, uint64_t now);
+    void retryQueries(uint64_t now);
+    void handleResponse(const unsigned char *buf, size_t len);
+    int nextTimeoutMs(uint64_t now) const;
+
+    std::vector<Query> queries;
+    CService server;
+    int sock;
+    size_t nPending;
+    uint64_t lastRound;
+    uint16_t nextId;
+    std::atomic<bool> stopping;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include "eviction.h"
+
+void EvictionHeap::siftUp(size_t index)
+{
+    EvictionNode *node = heap[index];
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (heap[parent]->score <= node->score) {
+            break;
+        }
+        place(heap[parent], index);
+        index = parent;
+    }
+    place(node, index);
+}
+
+void EvictionHeap::siftDown(size_t index)
+{
+    EvictionNode *node = heap[index];
+    size_t n = heap.size();
+    while (true) {
+        size_t child = index * 2 + 1;
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n && heap[child + 1]->score < heap[child]->score) {
+            child++;
+        }
+        if (node->score <= heap[child]->score) {
+            break;
+        }
+        place(heap[child], index);
+        index = child;
+    }
+    place(node, index);
+}
+
+void EvictionHeap::update(EvictionNode *node, int64_t score)
+{
+    if (!node->queued()) {
+        node->score = score;
+        heap.push_back(node);
+        siftUp(heap.size() - 1);
+        return;
+    }
+    int64_t old = node->score;
+    node->score = score;
+    if (score < old) {
+        siftUp(node->index);
+    } else if (score > old) {
+        siftDown(node->index);
+    }
+}
+
+void EvictionHeap::remove(EvictionNode *node)
+{
+    if (!node->queued()) {
+        return;
+    }
+    size_t index = node->index;
+    EvictionNode *last = heap.back();
+    heap.pop_back();
+    node->index = EvictionNode::NOT_QUEUED;
+    if (last == node) {
+        return;
+    }
+    place(last, index);
+    // the moved node may belong above or below its new position
+    siftUp(index);
+    siftDown(last->index);
+}
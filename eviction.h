@@ -0,0 +1,64 @@
+#ifndef __EVICTION_H__
+#define __EVICTION_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/*
+ * Intrusive entry of the eviction heap, embedded in the object it ranks.
+ * index is the node's position in the heap, NOT_QUEUED while outside.
+ */
+struct EvictionNode {
+    static const size_t NOT_QUEUED = static_cast<size_t>(-1);
+    EvictionNode(): score(0), index(NOT_QUEUED), ud(nullptr) {}
+    EvictionNode(const EvictionNode &other): score(other.score), index(NOT_QUEUED), ud(other.ud) {}
+    EvictionNode &operator=(const EvictionNode &other) {
+        // the heap position belongs to the heap and is never copied
+        score = other.score;
+        ud = other.ud;
+        return *this;
+    }
+    bool queued() const {
+        return index != NOT_QUEUED;
+    }
+    int64_t score;
+    size_t index;
+    void *ud;
+};
+
+/*
+ * Binary min-heap of EvictionNodes keyed by score, indexed through the
+ * nodes themselves so that update and remove of any node are O(log n)
+ * and the lowest-value node is found in O(1).
+ */
+class EvictionHeap
+{
+public:
+    EvictionHeap() = default;
+    EvictionHeap(const EvictionHeap &) = delete;
+    EvictionHeap &operator=(const EvictionHeap &) = delete;
+
+    // insert node, or move it if it is already queued
+    void update(EvictionNode *node, int64_t score);
+    void remove(EvictionNode *node);
+    // lowest score, nullptr when empty
+    EvictionNode *top() const {
+        return heap.empty() ? nullptr : heap[0];
+    }
+    size_t size() const {
+        return heap.size();
+    }
+
+private:
+    void place(EvictionNode *node, size_t index) {
+        heap[index] = node;
+        node->index = index;
+    }
+    void siftUp(size_t index);
+    void siftDown(size_t index);
+
+    std::vector<EvictionNode *> heap;
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include "reporter.h"
 #include <string>
 #include <vector>
+#include <functional>
 #include <mutex>
 #include <thread>
 #include <unistd.h>
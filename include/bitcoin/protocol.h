@@ -6,7 +6,6 @@
 #include <stdint.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
-#include <openssl/sha.h>
 
 //! nTime field added to CAddress, starting with this version;
 //! if possible, avoid requesting addresses nodes older than this
@@ -52,29 +51,68 @@ enum Network
     NET_UNROUTABLE = 0,
     NET_IPV4,
     NET_IPV6,
+    NET_ONION,
+    NET_I2P,
+    NET_CJDNS,
 
     NET_MAX,
 };
 
 static const unsigned char pchIPv4[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
 
-/** IP address (IPv6, or IPv4 using mapped IPv6 range (::FFFF:0:0/96)) */
+/**
+ * Tor v3 and I2P addresses are 32 bytes. They are interned in a
+ * process-wide table (netaddr.cpp) and a CNetAddr only holds their
+ * index, so every address stays as small as an IPv6 one.
+ */
+static const size_t NAMED_ADDR_SIZE = 32;
+uint32_t InternNamedAddr(const unsigned char *addr);
+std::string NamedAddrToString(Network net, uint32_t index);
+
+/**
+ * SipHash-2-4 of a 16-byte address and 32 more bits, under a key drawn
+ * once per process so that peers cannot aim addresses at one bucket.
+ */
+uint64_t HashAddrBytes(const unsigned char *ip, uint32_t extra);
+
+/**
+ * IP address (IPv6, or IPv4 using mapped IPv6 range (::FFFF:0:0/96)), a
+ * CJDNS address, or the index of an interned Tor v3 or I2P address.
+ */
 class CNetAddr
 {
     protected:
         unsigned char ip[16]; // in network byte order
-        uint32_t scopeId; // for scoped/link-local ipv6 addresses
+        uint32_t scopeId : 24; // for scoped/link-local ipv6 addresses
+        uint32_t net : 8; // enum Network
 
     public:
         CNetAddr() {
             memset(ip, 0, sizeof(ip));
             scopeId = 0;
+            net = NET_IPV6;
         }
         explicit CNetAddr(const struct in_addr& ipv4Addr) {
+            scopeId = 0;
             SetRaw(NET_IPV4, (const uint8_t*)&ipv4Addr);
         }
         void SetIP(const CNetAddr& ipIn) {
             memcpy(ip, ipIn.ip, sizeof(ip));
+            net = ipIn.net;
+        }
+        // a 32-byte Tor v3 public key or I2P hash
+        void SetNamed(Network network, const unsigned char *addr) {
+            assert(network == NET_ONION || network == NET_I2P);
+            uint32_t index = InternNamedAddr(addr);
+            memset(ip, 0, sizeof(ip));
+            memcpy(ip, &index, sizeof(index));
+            scopeId = 0;
+            net = network;
+        }
+        void SetCJDNS(const unsigned char *addr) {
+            memcpy(ip, addr, 16);
+            scopeId = 0;
+            net = NET_CJDNS;
         }
 
     private:
@@ -88,9 +126,12 @@ class CNetAddr
                 case NET_IPV4:
                     memcpy(ip, pchIPv4, 12);
                     memcpy(ip+12, ip_in, 4);
+                    net = NET_IPV4;
                     break;
                 case NET_IPV6:
                     memcpy(ip, ip_in, 16);
+                    // an IPv4-mapped address is IPv4
+                    net = memcmp(ip, pchIPv4, sizeof(pchIPv4)) == 0 ? NET_IPV4 : NET_IPV6;
                     break;
                 default:
                     assert(!"invalid network");
@@ -99,12 +140,22 @@ class CNetAddr
     public:
         // IPv4 mapped address (::FFFF:0:0/96, 0.0.0.0/0)
         bool IsIPv4() const {
-            return (memcmp(ip, pchIPv4, sizeof(pchIPv4)) == 0);
+            return net == NET_IPV4;
         }
         bool IsIPv6() const {
-            return !IsIPv4();
+            return net == NET_IPV6;
+        }
+        // reachable with a plain socket
+        bool IsIP() const {
+            return net == NET_IPV4 || net == NET_IPV6;
+        }
+        Network GetNetwork() const {
+            return static_cast<Network>(net);
         }
         bool IsLocal() const {
+            if (!IsIP())
+                return false;
+
             // IPv4 loopback
             if (IsIPv4() && (GetByte(3) == 127 || GetByte(3) == 0))
                 return true;
@@ -120,6 +171,11 @@ class CNetAddr
             return ToStringIP();
         }
         std::string ToStringIP() const {
+            if (net == NET_ONION || net == NET_I2P) {
+                uint32_t index;
+                memcpy(&index, ip, sizeof(index));
+                return NamedAddrToString(GetNetwork(), index);
+            }
             char buf[64];
             if (IsIPv4()) {
                 sprintf(buf, "%u.%u.%u.%u", GetByte(3), GetByte(2), GetByte(1), GetByte(0));
@@ -136,7 +192,7 @@ class CNetAddr
             return ip[15-n];
         }
         uint64_t GetHash() const {
-            return 0;
+            return HashAddrBytes(ip, net << 16);
         }
         bool GetInAddr(struct in_addr* pipv4Addr) const {
             if (!IsIPv4())
@@ -150,22 +206,41 @@ class CNetAddr
             scopeId = scope;
         }
         bool GetIn6Addr(struct in6_addr* pipv6Addr) const {
+            if (!IsIP())
+                return false;
             memcpy(pipv6Addr, ip, 16);
             return true;
         }
 
-        ADD_SERIALIZE_METHODS;
+        ADD_FIXED_SERIALIZE_METHODS
 
-        template <typename Stream, typename Operation>
-        inline void SerializationOp(Stream& s, Operation ser_action) {
-            READWRITE(ip);
+        template <typename Stream>
+        size_t GetFixedSize(const Stream&) const {
+            return 16;
+        }
+        template <typename Stream>
+        void EncodeFixed(const Stream&, unsigned char* p) const {
+            memcpy(p, ip, 16);
+        }
+        template <typename Stream>
+        void DecodeFixed(const Stream&, const unsigned char* p) {
+            SetRaw(NET_IPV6, p);
+            scopeId = 0;
         }
 
         friend bool operator<(const CNetAddr& a, const CNetAddr& b);
+        friend bool operator==(const CNetAddr& a, const CNetAddr& b);
 };
 
+inline bool operator==(const CNetAddr& a, const CNetAddr& b)
+{
+    return a.net == b.net && memcmp(a.ip, b.ip, 16) == 0;
+}
+
 inline bool operator<(const CNetAddr& a, const CNetAddr& b)
 {
+    if (a.net != b.net)
+        return a.net < b.net;
     return (memcmp(a.ip, b.ip, 16) < 0);
 }
 
@@ -180,7 +255,7 @@ class CService : public CNetAddr
         CService(const CNetAddr& ip, unsigned short port): CNetAddr(ip), port(port) {}
         CService(const struct in_addr& ipv4Addr, unsigned short port): CNetAddr(ipv4Addr), port(port) {}
         explicit CService(const struct sockaddr_in& addr): CNetAddr(addr.sin_addr), port(ntohs(addr.sin_port)) {};
-        explicit CService(const struct sockaddr_in6& addr): CNetAddr(addr.sin6_addr), port(ntohs(addr.sin6_port)) {};
+        explicit CService(const struct sockaddr_in6& addr): CNetAddr(addr.sin6_addr, addr.sin6_scope_id), port(ntohs(addr.sin6_port)) {};
         CService(const struct in6_addr& ipv6Addr, unsigned short port): CNetAddr(ipv6Addr), port(port) {}
         explicit CService(const struct sockaddr *addr) {
             SetSockAddr(addr);
@@ -188,6 +263,13 @@ class CService : public CNetAddr
         unsigned short GetPort() const {
             return port;
         }
+        // address and port, unlike the CNetAddr one
+        uint64_t GetHash() const {
+            return HashAddrBytes(ip, net << 16 | port);
+        }
+        friend bool operator==(const CService& a, const CService& b) {
+            return static_cast<const CNetAddr&>(a) == static_cast<const CNetAddr&>(b) && a.port == b.port;
+        }
         bool GetSockAddr(struct sockaddr* paddr, socklen_t *addrlen) const {
             if (IsIPv4()) {
                 if (*addrlen < (socklen_t)sizeof(struct sockaddr_in))
@@ -202,7 +284,18 @@ class CService : public CNetAddr
                 paddrin->sin_port = htons(port);
                 return true;
             } else {
-                return false;
+                if (*addrlen < (socklen_t)sizeof(struct sockaddr_in6))
+                    return false;
+                *addrlen = sizeof(struct sockaddr_in6);
+                struct sockaddr_in6 *paddrin6 = (struct sockaddr_in6*)paddr;
+                memset(paddrin6, 0, *addrlen);
+                if (!GetIn6Addr(&paddrin6->sin6_addr)) {
+                    return false;
+                }
+                paddrin6->sin6_scope_id = scopeId;
+                paddrin6->sin6_family = AF_INET6;
+                paddrin6->sin6_port = htons(port);
+                return true;
             }
         }
         bool SetSockAddr(const struct sockaddr* paddr) {
@@ -211,7 +304,8 @@ class CService : public CNetAddr
                     *this = CService(*(const struct sockaddr_in*)paddr);
                     return true;
                 case AF_INET6:
-                *this = CService(*(const struct sockaddr_in6*)paddr);
+                    *this = CService(*(const struct sockaddr_in6*)paddr);
+                    return true;
                 default:
                     return false;
             }
@@ -226,7 +320,7 @@ class CService : public CNetAddr
             return buf;
         }
         std::string ToStringIPPort() const {
-            if (IsIPv4()) {
+            if (IsIPv4() || net == NET_ONION || net == NET_I2P) {
                 return ToStringIP() + ":" + ToStringPort();
             } else {
                 return "[" + ToStringIP() + "]:" + ToStringPort();
@@ -236,12 +330,22 @@ class CService : public CNetAddr
         // CService(const struct in6_addr& ipv6Addr, unsigned short port);
         // explicit CService(const struct sockaddr_in6& addr);
 
-        ADD_SERIALIZE_METHODS;
+        ADD_FIXED_SERIALIZE_METHODS
 
-        template <typename Stream, typename Operation>
-        inline void SerializationOp(Stream& s, Operation ser_action) {
-            READWRITE(ip);
-            READWRITE(WrapBigEndian(port));
+        // ip, then the port in big-endian
+        template <typename Stream>
+        size_t GetFixedSize(const Stream&) const {
+            return 18;
+        }
+        template <typename Stream>
+        void EncodeFixed(const Stream& s, unsigned char* p) const {
+            CNetAddr::EncodeFixed(s, p);
+            ser_store16be(p + 16, port);
+        }
+        template <typename Stream>
+        void DecodeFixed(const Stream& s, const unsigned char* p) {
+            CNetAddr::DecodeFixed(s, p);
+            port = ser_load16be(p + 16);
         }
 };
 
@@ -264,23 +368,44 @@ public:
     }
 
 
-    ADD_SERIALIZE_METHODS;
-
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action)
-    {
-        if (ser_action.ForRead())
-            Init();
-        int nVersion = s.GetVersion();
-        if (s.GetType() & SER_DISK)
-            READWRITE(nVersion);
-        if (s.HaveTime() && ((s.GetType() & SER_DISK) ||
-            (nVersion >= CADDR_TIME_VERSION && !(s.GetType() & SER_GETHASH))))
-            READWRITE(nTime);
-        uint64_t nServicesInt = nServices;
-        READWRITE(nServicesInt);
-        nServices = static_cast<ServiceFlags>(nServicesInt);
-        READWRITEAS(CService, *this);
+    ADD_FIXED_SERIALIZE_METHODS
+
+    // [disk version] [time] services, then the CService; which of the
+    // optional fields are there is known from the stream alone
+    template <typename Stream>
+    static bool HasTime(const Stream& s) {
+        return s.HaveTime() && ((s.GetType() & SER_DISK) ||
+            (s.GetVersion() >= CADDR_TIME_VERSION && !(s.GetType() & SER_GETHASH)));
+    }
+    template <typename Stream>
+    size_t GetFixedSize(const Stream& s) const {
+        return ((s.GetType() & SER_DISK) ? 4 : 0) + (HasTime(s) ? 4 : 0) + 8 + 18;
+    }
+    template <typename Stream>
+    void EncodeFixed(const Stream& s, unsigned char* p) const {
+        if (s.GetType() & SER_DISK) {
+            ser_store32(p, s.GetVersion());
+            p += 4;
+        }
+        if (HasTime(s)) {
+            ser_store32(p, nTime);
+            p += 4;
+        }
+        ser_store64(p, nServices);
+        CService::EncodeFixed(s, p + 8);
+    }
+    template <typename Stream>
+    void DecodeFixed(const Stream& s, const unsigned char* p) {
+        Init();
+        if (s.GetType() & SER_DISK) {
+            p += 4;
+        }
+        if (HasTime(s)) {
+            nTime = ser_load32(p);
+            p += 4;
+        }
+        nServices = static_cast<ServiceFlags>(ser_load64(p));
+        CService::DecodeFixed(s, p + 8);
     }
 
     // TODO: make private (improves encapsulation)
@@ -291,10 +416,4 @@ public:
     unsigned int nTime;
 };
 
-static void dsha256(const unsigned char *s, size_t slen, unsigned char hash[32])
-{
-    unsigned char tmp[32];
-    SHA256(s, slen, tmp);
-    SHA256(tmp, 32, hash);
-}
 #endif
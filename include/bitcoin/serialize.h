@@ -125,6 +125,43 @@ template<typename Stream> inline uint64_t ser_readdata64(Stream &s)
     s.read((char*)&obj, 8);
     return le64toh(obj);
 }
+/*
+ * Unaligned little/big-endian stores and loads at a raw pointer, for
+ * types that encode themselves in one go (see ADD_FIXED_SERIALIZE_METHODS).
+ */
+inline void ser_store16be(unsigned char *p, uint16_t obj)
+{
+    obj = htobe16(obj);
+    memcpy(p, &obj, 2);
+}
+inline void ser_store32(unsigned char *p, uint32_t obj)
+{
+    obj = htole32(obj);
+    memcpy(p, &obj, 4);
+}
+inline void ser_store64(unsigned char *p, uint64_t obj)
+{
+    obj = htole64(obj);
+    memcpy(p, &obj, 8);
+}
+inline uint16_t ser_load16be(const unsigned char *p)
+{
+    uint16_t obj;
+    memcpy(&obj, p, 2);
+    return be16toh(obj);
+}
+inline uint32_t ser_load32(const unsigned char *p)
+{
+    uint32_t obj;
+    memcpy(&obj, p, 4);
+    return le32toh(obj);
+}
+inline uint64_t ser_load64(const unsigned char *p)
+{
+    uint64_t obj;
+    memcpy(&obj, p, 8);
+    return le64toh(obj);
+}
 inline uint64_t ser_double_to_uint64(double x)
 {
     union { double x; uint64_t y; } tmp;
@@ -190,6 +227,43 @@ template<typename X> const X& ReadWriteAsHelper(const X& x) { return x; }
         SerializationOp(s, CSerActionUnserialize());                  \
     }
 
+/**
+ * For types whose wire size is known before any field is written. Instead
+ * of SerializationOp they provide
+ *
+ *   template<typename Stream> size_t GetFixedSize(const Stream& s) const;
+ *   template<typename Stream> void EncodeFixed(const Stream& s, unsigned char* p) const;
+ *   template<typename Stream> void DecodeFixed(const Stream& s, const unsigned char* p);
+ *
+ * and are coded straight into the stream's memory with one bounds check,
+ * using the ser_store and ser_load helpers. The stream supplies the
+ * memory through WriteSpan(n) and ReadSpan(n).
+ */
+#define ADD_FIXED_SERIALIZE_METHODS                                   \
+    template<typename Stream>                                         \
+    void Serialize(Stream& s) const {                                 \
+        ::SerializeFixed(s, *this);                                   \
+    }                                                                 \
+    template<typename Stream>                                         \
+    void Unserialize(Stream& s) {                                     \
+        ::UnserializeFixed(s, *this);                                 \
+    }
+
+template<typename Stream, typename T>
+inline void SerializeFixed(Stream& s, const T& obj)
+{
+    obj.EncodeFixed(s, s.WriteSpan(obj.GetFixedSize(s)));
+}
+
+template<typename Stream, typename T>
+inline void UnserializeFixed(Stream& s, T& obj)
+{
+    obj.DecodeFixed(s, s.ReadSpan(obj.GetFixedSize(s)));
+}
+
+template<typename T>
+inline void SerializeFixed(CSizeComputer& s, const T& obj);
+
 template<typename Stream> inline void Serialize(Stream& s, char a    ) { ser_writedata8(s, a); } // TODO Get rid of bare char
 template<typename Stream> inline void Serialize(Stream& s, int8_t a  ) { ser_writedata8(s, a); }
 template<typename Stream> inline void Serialize(Stream& s, uint8_t a ) { ser_writedata8(s, a); }
@@ -903,8 +977,9 @@ protected:
 
     const int nType;
     const int nVersion;
+    const bool bHaveTime;
 public:
-    CSizeComputer(int nTypeIn, int nVersionIn) : nSize(0), nType(nTypeIn), nVersion(nVersionIn) {}
+    CSizeComputer(int nTypeIn, int nVersionIn, bool bHaveTimeIn = false) : nSize(0), nType(nTypeIn), nVersion(nVersionIn), bHaveTime(bHaveTimeIn) {}
 
     void write(const char *psz, size_t _nSize)
     {
@@ -931,8 +1006,15 @@ public:
 
     int GetVersion() const { return nVersion; }
     int GetType() const { return nType; }
+    bool HaveTime() const { return bHaveTime; }
 };
 
+template<typename T>
+inline void SerializeFixed(CSizeComputer& s, const T& obj)
+{
+    s.seek(obj.GetFixedSize(s));
+}
+
 template<typename Stream>
 void SerializeMany(Stream& s)
 {
@@ -993,7 +1075,16 @@ size_t GetSerializeSize(const T& t, int nType, int nVersion = 0)
 template <typename S, typename T>
 size_t GetSerializeSize(const S& s, const T& t)
 {
-    return (CSizeComputer(s.GetType(), s.GetVersion()) << t).size();
+    return (CSizeComputer(s.GetType(), s.GetVersion(), s.HaveTime()) << t).size();
+}
+
+/** Size of args serialized back to back with the settings of stream s. */
+template <typename S, typename... T>
+size_t GetSerializeSizeMany(const S& s, const T&... t)
+{
+    CSizeComputer sc(s.GetType(), s.GetVersion(), s.HaveTime());
+    ::SerializeMany(sc, t...);
+    return sc.size();
 }
 
 #endif // BITCOIN_SERIALIZE_H
@@ -31,11 +31,15 @@ class CVectorWriter
 /*
  * (other params same as above)
  * @param[in]  args  A list of items to serialize starting at nPosIn.
+ *
+ * The size of args is computed first, so the vector is allocated at most
+ * once however many fields are written.
 */
     template <typename... Args>
     CVectorWriter(bool bHaveTimeIn, int nTypeIn, uint32_t nVersionIn, std::vector<unsigned char>& vchDataIn, size_t nPosIn, Args&&... args) : 
         CVectorWriter(bHaveTimeIn, nTypeIn, nVersionIn, vchDataIn, nPosIn)
     {
+        vchData.reserve(nPos + ::GetSerializeSizeMany(*this, args...));
         ::SerializeMany(*this, std::forward<Args>(args)...);
     }
     void write(const char* pch, size_t nSize)
@@ -50,6 +54,17 @@ class CVectorWriter
         }
         nPos += nSize;
     }
+    // room for nSize bytes at the write position, filled in by the caller
+    unsigned char* WriteSpan(size_t nSize)
+    {
+        assert(nPos <= vchData.size());
+        if (nPos + nSize > vchData.size()) {
+            vchData.resize(nPos + nSize);
+        }
+        unsigned char* p = vchData.data() + nPos;
+        nPos += nSize;
+        return p;
+    }
     template<typename T>
     CVectorWriter& operator<<(const T& obj)
     {
@@ -89,33 +104,121 @@ private:
     bool bHaveTime;
 };
 
+/* Minimal stream writing into a caller-provided buffer of fixed capacity,
+ * e.g. a pooled message buffer
+ */
+class CBufferWriter
+{
+ public:
+/*
+ * @param[in]  pchDataIn  Buffer to write into
+ * @param[in]  nCapacityIn  Size of the buffer, writing past it is a bug
+ * @param[in]  nPosIn Starting position within the buffer
+*/
+    CBufferWriter(bool bHaveTimeIn, int nTypeIn, uint32_t nVersionIn, unsigned char* pchDataIn, size_t nCapacityIn, size_t nPosIn) :
+        bHaveTime(bHaveTimeIn), nType(nTypeIn), nVersion(nVersionIn), pchData(pchDataIn), nCapacity(nCapacityIn), nPos(nPosIn)
+    {
+        assert(nPos <= nCapacity);
+    }
+    template <typename... Args>
+    CBufferWriter(bool bHaveTimeIn, int nTypeIn, uint32_t nVersionIn, unsigned char* pchDataIn, size_t nCapacityIn, size_t nPosIn, Args&&... args) :
+        CBufferWriter(bHaveTimeIn, nTypeIn, nVersionIn, pchDataIn, nCapacityIn, nPosIn)
+    {
+        ::SerializeMany(*this, std::forward<Args>(args)...);
+    }
+    void write(const char* pch, size_t nSize)
+    {
+        assert(nPos + nSize <= nCapacity);
+        memcpy(pchData + nPos, pch, nSize);
+        nPos += nSize;
+    }
+    unsigned char* WriteSpan(size_t nSize)
+    {
+        assert(nPos + nSize <= nCapacity);
+        unsigned char* p = pchData + nPos;
+        nPos += nSize;
+        return p;
+    }
+    template<typename T>
+    CBufferWriter& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj);
+        return (*this);
+    }
+    int GetVersion() const
+    {
+        return nVersion;
+    }
+    int GetType() const
+    {
+        return nType;
+    }
+    int HaveTime() const
+    {
+        return bHaveTime;
+    }
+    size_t GetPos() const
+    {
+        return nPos;
+    }
+private:
+    bool bHaveTime;
+    int nType;
+    uint32_t nVersion;
+    unsigned char* pchData;
+    size_t nCapacity;
+    size_t nPos;
+};
+
 
 class CVectorReader
 {
 public:
     CVectorReader(bool bHaveTimeIn, int nTypeIn, int nVersionIn, const std::vector<unsigned char>& vchDataIn, size_t pos) : 
-        bHaveTime(bHaveTimeIn), nType(nTypeIn), nVersion(nVersionIn), vchData(vchDataIn), readPos(pos) {}
+        bHaveTime(bHaveTimeIn), nType(nTypeIn), nVersion(nVersionIn), pchData(vchDataIn.data()), nDataSize(vchDataIn.size()), readPos(pos) {}
+/*
+ * Read in place from a raw byte range, e.g. a payload inside a receive buffer
+ * @param[in]  pchDataIn  First byte of the range
+ * @param[in]  nSizeIn    Size of the range in bytes
+ */
+    CVectorReader(bool bHaveTimeIn, int nTypeIn, int nVersionIn, const unsigned char* pchDataIn, size_t nSizeIn, size_t pos) :
+        bHaveTime(bHaveTimeIn), nType(nTypeIn), nVersion(nVersionIn), pchData(pchDataIn), nDataSize(nSizeIn), readPos(pos) {}
 
     void read(const char* pch, size_t nSize)
     {
-        // printf("read %zu bytes, readPos=%zu, bufferSize=%zu\n", nSize, readPos, vchData.size());
+        // printf("read %zu bytes, readPos=%zu, bufferSize=%zu\n", nSize, readPos, nDataSize);
         // for (auto i = 0; i < nSize; i++) {
-        //     printf("%02x ", vchData[readPos+i]);
+        //     printf("%02x ", pchData[readPos+i]);
         // }
         // printf("\n");
-        assert(readPos <= vchData.size());
+        assert(readPos <= nDataSize);
         if (nSize == 0) {
             return;
         }
-        if (readPos + nSize > vchData.size()) {
+        if (readPos + nSize > nDataSize) {
             memset((void *)pch, 0, nSize);
-            readPos = vchData.size();
+            readPos = nDataSize;
         } else {
-            memcpy((void *)pch, &vchData[readPos], nSize);
+            memcpy((void *)pch, pchData + readPos, nSize);
             readPos += nSize;
         }
     }
 
+    // nSize bytes in place; past the end, zeros like read() gives
+    const unsigned char* ReadSpan(size_t nSize)
+    {
+        static const unsigned char zeros[64] = {0};
+        assert(readPos <= nDataSize);
+        if (readPos + nSize > nDataSize) {
+            assert(nSize <= sizeof(zeros));
+            readPos = nDataSize;
+            return zeros;
+        }
+        const unsigned char* p = pchData + readPos;
+        readPos += nSize;
+        return p;
+    }
+
     template<typename T>
     CVectorReader& operator>>(T& obj)
     {
@@ -125,7 +228,7 @@ public:
     }
     void skip(size_t span) {
         readPos += span;
-        assert(readPos <= vchData.size());
+        assert(readPos <= nDataSize);
     }
     int GetVersion() const
     {
@@ -146,7 +249,8 @@ public:
 private:
     int nType;
     int nVersion;
-    const std::vector<unsigned char>& vchData;
+    const unsigned char* pchData;
+    size_t nDataSize;
     size_t readPos;
     bool bHaveTime;
 };
@@ -1,10 +1,15 @@
 #include "init.h"
 #include "network.h"
 #include "http_reporter.h"
+#include "dnsseed.h"
 
 #include <signal.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
 #include <thread>
 #include <iostream>
+#include <memory>
 
 static const std::vector<std::string> seedNodes = {
     "seed.bitcoin.sipa.be",
@@ -25,19 +30,93 @@ void ignore(int sig)
 
 ReporterInterface *gReporter = nullptr;
 
+static int parseShardCount(int argc, char *argv[])
+{
+    int shards = std::thread::hardware_concurrency();
+    for (auto i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "-shards=", 8) == 0) {
+            shards = atoi(argv[i] + 8);
+        }
+    }
+    return shards > 0 ? shards : 1;
+}
+
+static NetworkOptions parseNetworkOptions(int argc, char *argv[])
+{
+    NetworkOptions options;
+    for (auto i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-crawl") == 0) {
+            options.crawl = true;
+        } else if (strcmp(argv[i], "-rst") == 0) {
+            options.rstClose = true;
+        } else if (strncmp(argv[i], "-bind=", 6) == 0) {
+            const char *ip = argv[i] + 6;
+            struct in_addr inAddr;
+            struct in6_addr in6Addr;
+            if (inet_pton(AF_INET, ip, &inAddr) == 1) {
+                options.sourceAddrs.push_back(CService(inAddr, 0));
+            } else if (inet_pton(AF_INET6, ip, &in6Addr) == 1) {
+                options.sourceAddrs.push_back(CService(in6Addr, 0));
+            } else {
+                printf("ignore invalid bind address %s\n", ip);
+            }
+        }
+    }
+    return options;
+}
+
+static bool parseDNSServer(int argc, char *argv[], CService &server)
+{
+    for (auto i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "-dnsserver=", 11) == 0) {
+            if (!DNSSeeder::parseServer(argv[i] + 11, server)) {
+                printf("invalid dns server %s\n", argv[i] + 11);
+                return false;
+            }
+            return true;
+        }
+    }
+    return DNSSeeder::defaultServer(server);
+}
+
 int main(int argc, char *argv[])
 {
     HttpReporter hp("http://127.0.0.1:8888/bitcoin_network/report");
     gReporter = &hp;
     std::thread t = gReporter->runThread();
 
-    initDNSSeedAddr(seedNodes);
-    NetworkEngine engine(70015);
+    CService dnsServer;
+    std::unique_ptr<DNSSeeder> seeder;
+    std::thread dnsThread;
+    if (parseDNSServer(argc, argv, dnsServer)) {
+        seeder.reset(new DNSSeeder(seedNodes, dnsServer));
+        if (seeder->init()) {
+            dnsThread = seeder->runThread();
+        } else {
+            printf("falling back to the system resolver\n");
+            seeder.reset();
+        }
+    }
+    if (!seeder) {
+        // no nameserver to talk to directly, fall back to the system resolver
+        initDNSSeedAddr(seedNodes);
+    }
+    auto stopSeeder = [&]() {
+        if (dnsThread.joinable()) {
+            seeder->stop();
+            dnsThread.join();
+        }
+    };
+    ShardedNetworkEngine engine(ADDRV2_VERSION, parseShardCount(argc, argv), parseNetworkOptions(argc, argv));
     if (!engine.initEngine()) {
         printf("network engine init failed, exit!\n");
+        stopSeeder();
+        // the reporter has no way to stop, let the exit take it down
+        t.detach();
         return -1;
     }
 
     signal(SIGPIPE, ignore);
     engine.startEngine();
+    stopSeeder();
 }
\ No newline at end of file
@@ -0,0 +1,334 @@
+#include "message.h"
+
+#include <bitcoin/stream.h>
+#include <bitcoin/endian.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+MessageCommand decodeCommand(const char command[12])
+{
+    uint64_t lo;
+    uint32_t hi;
+    memcpy(&lo, command, 8);
+    memcpy(&hi, command + 8, 4);
+    lo = le64toh(lo);
+    hi = le32toh(hi);
+    // commands of up to 8 characters leave the second word empty
+    switch (lo) {
+        case packCommandLo("version"):
+            return hi == 0 ? CMD_VERSION : CMD_UNKNOWN;
+        case packCommandLo("verack"):
+            return hi == 0 ? CMD_VERACK : CMD_UNKNOWN;
+        case packCommandLo("ping"):
+            return hi == 0 ? CMD_PING : CMD_UNKNOWN;
+        case packCommandLo("pong"):
+            return hi == 0 ? CMD_PONG : CMD_UNKNOWN;
+        case packCommandLo("addr"):
+            return hi == 0 ? CMD_ADDR : CMD_UNKNOWN;
+        case packCommandLo("addrv2"):
+            return hi == 0 ? CMD_ADDRV2 : CMD_UNKNOWN;
+        case packCommandLo("getaddr"):
+            return hi == 0 ? CMD_GETADDR : CMD_UNKNOWN;
+        case packCommandLo("inv"):
+            return hi == 0 ? CMD_INV : CMD_UNKNOWN;
+        case packCommandLo("reject"):
+            return hi == 0 ? CMD_REJECT : CMD_UNKNOWN;
+        case packCommandLo("getheaders"):
+            return hi == packCommandHi("getheaders") ? CMD_GETHEADERS : CMD_UNKNOWN;
+        case packCommandLo("sendheaders"):
+            return hi == packCommandHi("sendheaders") ? CMD_SENDHEADERS : CMD_UNKNOWN;
+        case packCommandLo("sendcmpct"):
+            return hi == packCommandHi("sendcmpct") ? CMD_SENDCMPCT : CMD_UNKNOWN;
+        case packCommandLo("feefilter"):
+            return hi == packCommandHi("feefilter") ? CMD_FEEFILTER : CMD_UNKNOWN;
+        case packCommandLo("sendaddrv2"):
+            return hi == packCommandHi("sendaddrv2") ? CMD_SENDADDRV2 : CMD_UNKNOWN;
+        case packCommandLo("wtxidrelay"):
+            return hi == packCommandHi("wtxidrelay") ? CMD_WTXIDRELAY : CMD_UNKNOWN;
+        default:
+            return CMD_UNKNOWN;
+    }
+}
+
+CommandPolicy commandPolicy(MessageCommand command)
+{
+    switch (command) {
+        case CMD_VERSION:
+            return {PAYLOAD_BUFFER, MAX_VERSION_LENGTH};
+        case CMD_VERACK:
+            return {PAYLOAD_BUFFER, 0};
+        case CMD_PING:
+            return {PAYLOAD_BUFFER, 8};
+        case CMD_ADDR:
+            return {PAYLOAD_STREAM, 9 + MAX_ADDR_PER_MESSAGE * ADDR_RECORD_SIZE};
+        case CMD_ADDRV2:
+            return {PAYLOAD_STREAM, 9 + MAX_ADDR_PER_MESSAGE * MAX_ADDRV2_RECORD_SIZE};
+        default:
+            // not needed for crawling
+            return {PAYLOAD_SKIP, MAX_PROTOCOL_MESSAGE_LENGTH};
+    }
+}
+
+size_t decodeCompactSize(const unsigned char *data, size_t size, uint64_t &value)
+{
+    if (size < 1) {
+        return 0;
+    }
+    unsigned char first = data[0];
+    size_t len = first < 253 ? 1 : first == 253 ? 3 : first == 254 ? 5 : 9;
+    if (size < len) {
+        return 0;
+    }
+    if (len == 1) {
+        value = first;
+    } else {
+        uint64_t word = 0;
+        memcpy(&word, data + 1, len - 1);
+        value = le64toh(word);
+    }
+    return len;
+}
+
+// ::ffff:0.0.0.0 and ::ffff:255.255.255.255
+static const unsigned char IPV4_ANY[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0, 0, 0, 0};
+static const unsigned char IPV4_BROADCAST[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+static void validateAddrBatch(AddrBatch &batch)
+{
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i any = _mm_loadu_si128(reinterpret_cast<const __m128i *>(IPV4_ANY));
+    const __m128i broadcast = _mm_loadu_si128(reinterpret_cast<const __m128i *>(IPV4_BROADCAST));
+    for (size_t i = 0; i < batch.count; ++i) {
+        __m128i ip = _mm_loadu_si128(reinterpret_cast<const __m128i *>(batch.ip[i]));
+        // a full mask means all 16 bytes equal one of the unusable addresses
+        bool unusable = _mm_movemask_epi8(_mm_cmpeq_epi8(ip, zero)) == 0xffff ||
+            _mm_movemask_epi8(_mm_cmpeq_epi8(ip, any)) == 0xffff ||
+            _mm_movemask_epi8(_mm_cmpeq_epi8(ip, broadcast)) == 0xffff;
+        batch.valid[i] = !unusable && batch.port[i] != 0;
+    }
+#else
+    static const unsigned char IPV6_ANY[16] = {0};
+    for (size_t i = 0; i < batch.count; ++i) {
+        const unsigned char *ip = batch.ip[i];
+        bool unusable = memcmp(ip, IPV6_ANY, 16) == 0 || memcmp(ip, IPV4_ANY, 16) == 0 ||
+            memcmp(ip, IPV4_BROADCAST, 16) == 0;
+        batch.valid[i] = !unusable && batch.port[i] != 0;
+    }
+#endif
+}
+
+void decodeAddrRecords(const unsigned char *data, size_t count, bool haveTime, AddrBatch &batch)
+{
+    assert(count <= MAX_ADDR_PER_MESSAGE);
+    size_t recordSize = haveTime ? ADDR_RECORD_SIZE : ADDR_RECORD_SIZE_NOTIME;
+    batch.count = count;
+    const unsigned char *record = data;
+    for (size_t i = 0; i < count; ++i, record += recordSize) {
+        if (haveTime) {
+            memcpy(&batch.time[i], record, 4);
+        } else {
+            batch.time[i] = 0;
+        }
+        const unsigned char *p = record + (haveTime ? 4 : 0);
+        memcpy(&batch.services[i], p, 8);
+        memcpy(batch.ip[i], p + 8, 16);
+        memcpy(&batch.port[i], p + 24, 2);
+    }
+    // byte order is fixed up a column at a time, where the compiler can
+    // vectorize it or, on little-endian hosts, drop it
+    for (size_t i = 0; i < count; ++i) {
+        batch.time[i] = le32toh(batch.time[i]);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        batch.services[i] = le64toh(batch.services[i]);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        batch.port[i] = be16toh(batch.port[i]);
+    }
+    validateAddrBatch(batch);
+}
+
+// BIP155 network ids
+enum AddrV2Network {
+    ADDRV2_IPV4 = 1,
+    ADDRV2_IPV6 = 2,
+    ADDRV2_TORV2 = 3,
+    ADDRV2_TORV3 = 4,
+    ADDRV2_I2P = 5,
+    ADDRV2_CJDNS = 6
+};
+
+// the unusable addresses validateAddrBatch filters, one at a time
+static bool usableIP(const unsigned char *ip, uint16_t port)
+{
+    static const unsigned char IPV6_ANY[16] = {0};
+    return port != 0 && memcmp(ip, IPV6_ANY, 16) != 0 && memcmp(ip, IPV4_ANY, 16) != 0 &&
+        memcmp(ip, IPV4_BROADCAST, 16) != 0;
+}
+
+bool decodeAddrV2Record(const unsigned char *data, size_t size, size_t &len, CService &addr, bool &usable)
+{
+    len = 0;
+    usable = false;
+    // time, compact size services, network id, compact size length
+    size_t pos = 4;
+    uint64_t services, addrSize;
+    if (size < pos) {
+        return true;
+    }
+    size_t n = decodeCompactSize(data + pos, size - pos, services);
+    if (n == 0) {
+        return true;
+    }
+    pos += n;
+    if (size < pos + 1) {
+        return true;
+    }
+    unsigned char network = data[pos++];
+    n = decodeCompactSize(data + pos, size - pos, addrSize);
+    if (n == 0) {
+        return true;
+    }
+    pos += n;
+    if (addrSize > MAX_ADDRV2_ADDR_SIZE) {
+        return false;
+    }
+    if (size < pos + addrSize + 2) {
+        return true;
+    }
+    const unsigned char *raw = data + pos;
+    uint16_t port = static_cast<uint16_t>(data[pos + addrSize] << 8 | data[pos + addrSize + 1]);
+    len = pos + addrSize + 2;
+
+    // a known network with the wrong address size makes the message invalid,
+    // unknown networks are skipped
+    switch (network) {
+        case ADDRV2_IPV4: {
+            if (addrSize != 4) {
+                return false;
+            }
+            struct in_addr ip4;
+            memcpy(&ip4, raw, 4);
+            addr = CService(ip4, port);
+            unsigned char mapped[16];
+            memcpy(mapped, pchIPv4, 12);
+            memcpy(mapped + 12, raw, 4);
+            usable = usableIP(mapped, port);
+            return true;
+        }
+        case ADDRV2_IPV6: {
+            if (addrSize != 16) {
+                return false;
+            }
+            struct in6_addr ip6;
+            memcpy(&ip6, raw, 16);
+            addr = CService(ip6, port);
+            // IPv4 is sent as IPv4, and bitcoind ignores embedded addresses
+            usable = addr.IsIPv6() && usableIP(raw, port);
+            return true;
+        }
+        case ADDRV2_TORV2:
+            // retired by Tor, nobody can reach these any more
+            return addrSize == 10;
+        case ADDRV2_TORV3:
+        case ADDRV2_I2P: {
+            if (addrSize != NAMED_ADDR_SIZE) {
+                return false;
+            }
+            CNetAddr named;
+            named.SetNamed(network == ADDRV2_TORV3 ? NET_ONION : NET_I2P, raw);
+            addr = CService(named, port);
+            usable = true;
+            return true;
+        }
+        case ADDRV2_CJDNS: {
+            if (addrSize != 16) {
+                return false;
+            }
+            // CJDNS addresses are all in fc00::/8
+            if (raw[0] != 0xfc) {
+                return true;
+            }
+            CNetAddr cjdns;
+            cjdns.SetCJDNS(raw);
+            addr = CService(cjdns, port);
+            usable = true;
+            return true;
+        }
+        default:
+            return true;
+    }
+}
+
+const unsigned char VERACK_MESSAGE[MESSAGE_HEADER_SIZE] = {
+    0xf9, 0xbe, 0xb4, 0xd9,
+    'v', 'e', 'r', 'a', 'c', 'k', 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0,
+    0x5d, 0xf6, 0xe0, 0xe2
+};
+
+const unsigned char GETADDR_MESSAGE[MESSAGE_HEADER_SIZE] = {
+    0xf9, 0xbe, 0xb4, 0xd9,
+    'g', 'e', 't', 'a', 'd', 'd', 'r', 0, 0, 0, 0, 0,
+    0, 0, 0, 0,
+    0x5d, 0xf6, 0xe0, 0xe2
+};
+
+const unsigned char SENDADDRV2_MESSAGE[MESSAGE_HEADER_SIZE] = {
+    0xf9, 0xbe, 0xb4, 0xd9,
+    's', 'e', 'n', 'd', 'a', 'd', 'd', 'r', 'v', '2', 0, 0,
+    0, 0, 0, 0,
+    0x5d, 0xf6, 0xe0, 0xe2
+};
+
+const unsigned char PONG_HEADER[MESSAGE_HEADER_SIZE] = {
+    0xf9, 0xbe, 0xb4, 0xd9,
+    'p', 'o', 'n', 'g', 0, 0, 0, 0, 0, 0, 0, 0,
+    8, 0, 0, 0,
+    0, 0, 0, 0
+};
+
+VersionTemplate::VersionTemplate(uint32_t _version): version(_version)
+{
+    // the variable fields are serialized as zero and patched by build
+    assert(version >= 106);
+    CVersionPayload versionPayload;
+    versionPayload.version = version;
+    versionPayload.services = static_cast<uint64_t>(NODE_NETWORK);
+    versionPayload.addrMe = CAddress(CService(), version, 0);
+    versionPayload.addrYou = CAddress(CService(), version, 0);
+    versionPayload.user_agent = "/Satoshi:0.14.2/";
+    versionPayload.start_height = 0;
+    versionPayload.relay = false;
+    // sized first, so header and payload are written in one pass
+    CSizeComputer sizer(SER_NETWORK, version, false);
+    sizer << versionPayload;
+    assert(MESSAGE_HEADER_SIZE + sizer.size() <= sizeof(data));
+    unsigned char checksum[4] = {0};
+    CMessageHeader hdr(MAIN_MAGIC, "version", sizer.size(), checksum);
+    CBufferWriter writer(false, SER_NETWORK, version, data, sizeof(data), 0, hdr, versionPayload);
+    size = writer.GetPos();
+}
+
+void VersionTemplate::build(MessageBuffer *msg, int64_t timestamp, uint64_t nonce, const CService &addrMe, const CService &addrYou) const
+{
+    memcpy(msg->data, data, size);
+    msg->size = size;
+    CBufferWriter{false, SER_NETWORK, version, msg->data, size, TIMESTAMP_OFFSET, timestamp};
+    CBufferWriter{false, SER_NETWORK, version, msg->data, size, ADDR_ME_OFFSET + ADDR_IP_OFFSET, addrMe};
+    CBufferWriter{false, SER_NETWORK, version, msg->data, size, ADDR_YOU_OFFSET + ADDR_IP_OFFSET, addrYou};
+    CBufferWriter{false, SER_NETWORK, version, msg->data, size, NONCE_OFFSET, nonce};
+}
+
+void MessagePool::grow()
+{
+    MessageBuffer *slab = new MessageBuffer[POOL_SLAB_BUFFERS];
+    slabs.emplace_back(slab);
+    for (auto i = 0; i < POOL_SLAB_BUFFERS; ++i) {
+        slab[i].next = freeList;
+        freeList = &slab[i];
+    }
+}
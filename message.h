@@ -6,9 +6,25 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <memory>
+#include <vector>
 
 static const uint32_t MAIN_MAGIC = 0xD9B4BEF9;
 static const int MESSAGE_HEADER_SIZE = 24;
+// the largest message a peer may send us
+static const uint32_t MAX_PROTOCOL_MESSAGE_LENGTH = 4 * 1000 * 1000;
+// the most addresses a peer puts into one addr message
+static const uint32_t MAX_ADDR_PER_MESSAGE = 1000;
+// an addr record: time (from CADDR_TIME_VERSION), services, ip and port
+static const size_t ADDR_RECORD_SIZE = 30;
+static const size_t ADDR_RECORD_SIZE_NOTIME = 26;
+// BIP155: addrv2 records carry variable-length addresses of up to 512 bytes
+static const size_t MAX_ADDRV2_ADDR_SIZE = 512;
+static const size_t MAX_ADDRV2_RECORD_SIZE = 4 + 9 + 1 + 3 + MAX_ADDRV2_ADDR_SIZE + 2;
+// the first protocol version that understands sendaddrv2
+static const uint32_t ADDRV2_VERSION = 70016;
+// a version message with the longest user agent bitcoind accepts fits
+static const uint32_t MAX_VERSION_LENGTH = 512;
 
 class CMessageHeader
 {
@@ -31,7 +47,7 @@ public:
     uint32_t payloadLength;
     uint32_t checksum;
 
-    ADD_SERIALIZE_METHODS
+    ADD_FIXED_SERIALIZE_METHODS
 
     void init() {
         magic = 0;
@@ -40,18 +56,145 @@ public:
         checksum = 0;
     }
 
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action) {
-        if (ser_action.ForRead()) {
-            init();
-        }
-        READWRITE(magic);
-        READWRITE(command);
-        READWRITE(payloadLength);
-        READWRITE(checksum);
+    // the checksum is kept in wire order, as the constructor does
+    void encode(unsigned char *p) const {
+        ser_store32(p, magic);
+        memcpy(p + 4, command, 12);
+        ser_store32(p + 16, payloadLength);
+        memcpy(p + 20, &checksum, 4);
+    }
+    void decode(const unsigned char *p) {
+        magic = ser_load32(p);
+        memcpy(command, p + 4, 12);
+        payloadLength = ser_load32(p + 16);
+        memcpy(&checksum, p + 20, 4);
+    }
+
+    template <typename Stream>
+    size_t GetFixedSize(const Stream &) const {
+        return MESSAGE_HEADER_SIZE;
+    }
+    template <typename Stream>
+    void EncodeFixed(const Stream &, unsigned char *p) const {
+        encode(p);
     }
+    template <typename Stream>
+    void DecodeFixed(const Stream &, const unsigned char *p) {
+        decode(p);
+    }
+};
+
+/*
+ * Commands we tell apart. Anything else is CMD_UNKNOWN and its payload is
+ * skipped.
+ */
+enum MessageCommand {
+    CMD_UNKNOWN,
+    CMD_VERSION,
+    CMD_VERACK,
+    CMD_PING,
+    CMD_PONG,
+    CMD_ADDR,
+    CMD_ADDRV2,
+    CMD_GETADDR,
+    CMD_INV,
+    CMD_GETHEADERS,
+    CMD_SENDHEADERS,
+    CMD_SENDCMPCT,
+    CMD_FEEFILTER,
+    CMD_SENDADDRV2,
+    CMD_WTXIDRELAY,
+    CMD_REJECT
+};
+
+/*
+ * The 12-byte NUL-padded command, packed into its first 8 and last 4
+ * bytes read as little-endian integers. Literals are packed at compile
+ * time, so matching a command is one switch over the first word plus a
+ * compare of the second.
+ */
+constexpr uint64_t packCommandLo(const char *cmd, int i = 0)
+{
+    return (i == 8 || cmd[i] == 0) ? 0 :
+        (static_cast<uint64_t>(static_cast<unsigned char>(cmd[i])) << (8 * i)) | packCommandLo(cmd, i + 1);
+}
+
+constexpr uint32_t packCommandHi(const char *cmd, int i = 0)
+{
+    return (i < 8) ? ((cmd[i] == 0) ? 0 : packCommandHi(cmd, i + 1)) :
+        (i == 12 || cmd[i] == 0) ? 0 :
+        (static_cast<uint32_t>(static_cast<unsigned char>(cmd[i])) << (8 * (i - 8))) | packCommandHi(cmd, i + 1);
+}
+
+MessageCommand decodeCommand(const char command[12]);
+
+// decode a raw 24-byte header without going through a stream
+inline void decodeHeader(const unsigned char *raw, CMessageHeader &header)
+{
+    header.decode(raw);
+}
+
+// a message payload viewed in place, valid until the message is consumed
+struct MessageSpan
+{
+    MessageSpan(const unsigned char *_data, size_t _size): data(_data), size(_size) {}
+    const unsigned char *data;
+    size_t size;
+};
+
+/*
+ * How the payload of a command is read: kept in the receive ring until
+ * it is complete, decoded record by record as it arrives, or dropped as
+ * it arrives without being kept or verified. A header announcing more
+ * than maxLength closes the connection.
+ */
+enum PayloadMode {
+    PAYLOAD_BUFFER,
+    PAYLOAD_STREAM,
+    PAYLOAD_SKIP
+};
+
+struct CommandPolicy
+{
+    PayloadMode mode;
+    uint32_t maxLength;
 };
 
+CommandPolicy commandPolicy(MessageCommand command);
+
+/*
+ * The records of one addr message as a structure of arrays, fields in
+ * host order. valid is cleared for records no one can connect to: an
+ * unspecified or broadcast ip, or port 0.
+ */
+struct AddrBatch
+{
+    size_t count;
+    uint32_t time[MAX_ADDR_PER_MESSAGE];
+    uint64_t services[MAX_ADDR_PER_MESSAGE];
+    unsigned char ip[MAX_ADDR_PER_MESSAGE][16];
+    uint16_t port[MAX_ADDR_PER_MESSAGE];
+    bool valid[MAX_ADDR_PER_MESSAGE];
+};
+
+// compact size at data, returns its length or 0 when it is cut short
+size_t decodeCompactSize(const unsigned char *data, size_t size, uint64_t &value);
+
+// decode count consecutive addr records, at most MAX_ADDR_PER_MESSAGE
+void decodeAddrRecords(const unsigned char *data, size_t count, bool haveTime, AddrBatch &batch);
+
+/*
+ * Decode one addrv2 record at data. len is its size, or 0 when it is cut
+ * short. usable is set when addr is an address we know. false means the
+ * record is malformed.
+ */
+bool decodeAddrV2Record(const unsigned char *data, size_t size, size_t &len, CService &addr, bool &usable);
+
+inline size_t addrRecordSize(uint32_t version)
+{
+    return version >= CADDR_TIME_VERSION ? ADDR_RECORD_SIZE : ADDR_RECORD_SIZE_NOTIME;
+}
+
 class CVersionPayload
 {
 public:
@@ -95,6 +238,84 @@ public:
     bool relay;
 };
 
+// every message we send (version, verack, pong) fits in one buffer
+static const size_t MESSAGE_BUFFER_SIZE = 256;
+
+/*
+ * Fixed-size outgoing message buffer. next links it into either the
+ * pool's free list or a connection's send queue.
+ */
+struct MessageBuffer
+{
+    MessageBuffer *next;
+    size_t size;
+    unsigned char data[MESSAGE_BUFFER_SIZE];
+};
+
+/*
+ * Pool of MessageBuffers carved out of slabs and recycled through a free
+ * list. Each shard owns one, so alloc and release take no lock and do not
+ * touch malloc once the pool has grown to the working set.
+ */
+class MessagePool
+{
+public:
+    MessagePool(): freeList(nullptr) {}
+    MessagePool(const MessagePool &) = delete;
+    MessagePool &operator=(const MessagePool &) = delete;
+    MessageBuffer *alloc() {
+        if (freeList == nullptr) {
+            grow();
+        }
+        MessageBuffer *buf = freeList;
+        freeList = buf->next;
+        buf->next = nullptr;
+        buf->size = 0;
+        return buf;
+    }
+    void release(MessageBuffer *buf) {
+        buf->next = freeList;
+        freeList = buf;
+    }
+private:
+    static const int POOL_SLAB_BUFFERS = 256;
+    void grow();
+    MessageBuffer *freeList;
+    std::vector<std::unique_ptr<MessageBuffer[]>> slabs;
+};
+
+/*
+ * Messages serialized once instead of for every peer. verack, getaddr
+ * and sendaddrv2 never change and carry the constant checksum of an empty payload. pong
+ * and version get their variable fields patched in and are checksummed
+ * when the send queue is sealed.
+ */
+extern const unsigned char VERACK_MESSAGE[MESSAGE_HEADER_SIZE];
+extern const unsigned char GETADDR_MESSAGE[MESSAGE_HEADER_SIZE];
+extern const unsigned char SENDADDRV2_MESSAGE[MESSAGE_HEADER_SIZE];
+extern const unsigned char PONG_HEADER[MESSAGE_HEADER_SIZE];
 
+class VersionTemplate
+{
+public:
+    explicit VersionTemplate(uint32_t version);
+    // the version message for one connection, without its checksum
+    void build(MessageBuffer *msg, int64_t timestamp, uint64_t nonce, const CService &addrMe, const CService &addrYou) const;
+    uint32_t getVersion() const {
+        return version;
+    }
+private:
+    // fixed positions in a version >= 106 payload, ahead of the user agent
+    static const size_t TIMESTAMP_OFFSET = MESSAGE_HEADER_SIZE + 12;
+    static const size_t ADDR_ME_OFFSET = MESSAGE_HEADER_SIZE + 20;
+    static const size_t ADDR_YOU_OFFSET = MESSAGE_HEADER_SIZE + 46;
+    static const size_t NONCE_OFFSET = MESSAGE_HEADER_SIZE + 72;
+    // an address is serialized as services, ip and port
+    static const size_t ADDR_IP_OFFSET = 8;
+
+    uint32_t version;
+    size_t size;
+    unsigned char data[MESSAGE_BUFFER_SIZE];
+};
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,202 @@
+#include <bitcoin/protocol.h>
+
+#include <string.h>
+#include <array>
+#include <map>
+#include <mutex>
+#include <random>
+#include <vector>
+
+namespace {
+
+typedef std::array<unsigned char, NAMED_ADDR_SIZE> NamedAddr;
+
+// addresses are only ever added, an index stays valid for the process
+std::mutex internLock;
+std::map<NamedAddr, uint32_t> internIndex;
+std::vector<NamedAddr> internTable;
+
+const uint64_t KECCAK_RC[24] = {
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808aULL, 0x8000000080008000ULL,
+    0x000000000000808bULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+    0x000000000000008aULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000aULL,
+    0x000000008000808bULL, 0x800000000000008bULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+    0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800aULL, 0x800000008000000aULL,
+    0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+const int KECCAK_ROTC[24] = {1, 3, 6, 10, 15, 21, 28, 36, 45, 55, 2, 14, 27, 41, 56, 8, 25, 43, 62, 18, 39, 61, 20, 44};
+const int KECCAK_PILN[24] = {10, 7, 11, 17, 18, 3, 5, 16, 8, 21, 24, 4, 15, 23, 19, 13, 12, 2, 20, 14, 22, 9, 6, 1};
+
+inline uint64_t rotl64(uint64_t x, int n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+void keccakF1600(uint64_t st[25])
+{
+    for (int round = 0; round < 24; ++round) {
+        uint64_t bc[5];
+        for (int i = 0; i < 5; ++i) {
+            bc[i] = st[i] ^ st[i + 5] ^ st[i + 10] ^ st[i + 15] ^ st[i + 20];
+        }
+        for (int i = 0; i < 5; ++i) {
+            uint64_t t = bc[(i + 4) % 5] ^ rotl64(bc[(i + 1) % 5], 1);
+            for (int j = 0; j < 25; j += 5) {
+                st[j + i] ^= t;
+            }
+        }
+        uint64_t t = st[1];
+        for (int i = 0; i < 24; ++i) {
+            int j = KECCAK_PILN[i];
+            uint64_t next = st[j];
+            st[j] = rotl64(t, KECCAK_ROTC[i]);
+            t = next;
+        }
+        for (int j = 0; j < 25; j += 5) {
+            for (int i = 0; i < 5; ++i) {
+                bc[i] = st[j + i];
+            }
+            for (int i = 0; i < 5; ++i) {
+                st[j + i] ^= (~bc[(i + 1) % 5]) & bc[(i + 2) % 5];
+            }
+        }
+        st[0] ^= KECCAK_RC[round];
+    }
+}
+
+// SHA3-256 of a message shorter than one 136-byte block, enough for the
+// Tor v3 checksum
+void sha3_256Short(const unsigned char *data, size_t len, unsigned char hash[32])
+{
+    static const size_t RATE = 136;
+    assert(len < RATE);
+    unsigned char block[RATE] = {0};
+    memcpy(block, data, len);
+    block[len] ^= 0x06;
+    block[RATE - 1] ^= 0x80;
+    uint64_t st[25] = {0};
+    for (size_t i = 0; i < RATE / 8; ++i) {
+        uint64_t lane = 0;
+        for (int b = 0; b < 8; ++b) {
+            lane |= static_cast<uint64_t>(block[i * 8 + b]) << (8 * b);
+        }
+        st[i] ^= lane;
+    }
+    keccakF1600(st);
+    for (int i = 0; i < 32; ++i) {
+        hash[i] = static_cast<unsigned char>(st[i / 8] >> (8 * (i % 8)));
+    }
+}
+
+struct SipKey {
+    SipKey() {
+        std::random_device rd;
+        k0 = (static_cast<uint64_t>(rd()) << 32) | rd();
+        k1 = (static_cast<uint64_t>(rd()) << 32) | rd();
+    }
+    uint64_t k0;
+    uint64_t k1;
+};
+
+#define SIPROUND do { \
+    v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32); \
+    v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32); \
+} while (0)
+
+std::string encodeBase32(const unsigned char *data, size_t len)
+{
+    static const char ALPHABET[] = "abcdefghijklmnopqrstuvwxyz234567";
+    std::string out;
+    uint32_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < len; ++i) {
+        acc = (acc << 8) | data[i];
+        bits += 8;
+        while (bits >= 5) {
+            bits -= 5;
+            out += ALPHABET[(acc >> bits) & 31];
+        }
+    }
+    if (bits > 0) {
+        out += ALPHABET[(acc << (5 - bits)) & 31];
+    }
+    return out;
+}
+
+}
+
+uint64_t HashAddrBytes(const unsigned char *ip, uint32_t extra)
+{
+    static const SipKey key;
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key.k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ key.k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key.k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ key.k1;
+    // the message is always 20 bytes: two words of address, then extra
+    // in the last word together with the length
+    uint64_t words[2];
+    memcpy(words, ip, 16);
+    for (int i = 0; i < 2; ++i) {
+        uint64_t m = le64toh(words[i]);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+    uint64_t last = (static_cast<uint64_t>(20) << 56) | extra;
+    v3 ^= last;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= last;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint32_t InternNamedAddr(const unsigned char *addr)
+{
+    NamedAddr key;
+    memcpy(key.data(), addr, NAMED_ADDR_SIZE);
+    std::lock_guard<std::mutex> lock(internLock);
+    auto pair = internIndex.insert(std::make_pair(key, static_cast<uint32_t>(internTable.size())));
+    if (pair.second) {
+        internTable.push_back(key);
+    }
+    return pair.first->second;
+}
+
+std::string NamedAddrToString(Network net, uint32_t index)
+{
+    NamedAddr key;
+    {
+        std::lock_guard<std::mutex> lock(internLock);
+        if (index >= internTable.size()) {
+            return "";
+        }
+        key = internTable[index];
+    }
+    if (net == NET_I2P) {
+        return encodeBase32(key.data(), key.size()) + ".b32.i2p";
+    }
+    // Tor v3: base32(pubkey | checksum | version), the checksum being the
+    // first two bytes of SHA3-256(".onion checksum" | pubkey | version)
+    static const char PREFIX[] = ".onion checksum";
+    static const unsigned char TORV3_VERSION = 3;
+    unsigned char buf[sizeof(PREFIX) - 1 + NAMED_ADDR_SIZE + 1];
+    memcpy(buf, PREFIX, sizeof(PREFIX) - 1);
+    memcpy(buf + sizeof(PREFIX) - 1, key.data(), NAMED_ADDR_SIZE);
+    buf[sizeof(buf) - 1] = TORV3_VERSION;
+    unsigned char checksum[32];
+    sha3_256Short(buf, sizeof(buf), checksum);
+    unsigned char name[NAMED_ADDR_SIZE + 3];
+    memcpy(name, key.data(), NAMED_ADDR_SIZE);
+    name[NAMED_ADDR_SIZE] = checksum[0];
+    name[NAMED_ADDR_SIZE + 1] = checksum[1];
+    name[NAMED_ADDR_SIZE + 2] = TORV3_VERSION;
+    return encodeBase32(name, sizeof(name)) + ".onion";
+}
@@ -2,6 +2,7 @@
 #include "network.h"
 #include "message.h"
 #include "reporter.h"
+#include "sha256.h"
 
 #include <bitcoin/serialize.h>
 #include <bitcoin/stream.h>
@@ -18,6 +19,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <vector>
+#include <algorithm>
 #include <iostream>
 
 
@@ -25,204 +27,606 @@ extern ReporterInterface *gReporter;
 static const int DRAIN_SEED_SIZE_PER_LOOP = 128;
 
 
-bool Connection::sendBuffer(bool &moreWrite)
+void SendQueue::push(MessageBuffer *msg)
 {
-    while (!sendingBuffer.empty()) {
-        std::vector<unsigned char> &buffer = sendingBuffer.front();
-        int bytesToSend = buffer.size() - sendPos;
-        if (bytesToSend <= 0) {
-            sendPos = 0;
-            sendingBuffer.pop_front();
-            continue;
+    msg->next = nullptr;
+    if (tail == nullptr) {
+        head = tail = msg;
+    } else {
+        tail->next = msg;
+        tail = msg;
+    }
+    if (unsealed == nullptr) {
+        unsealed = msg;
+    }
+}
+
+void SendQueue::seal(std::vector<MessageBuffer *> &msgs)
+{
+    for (MessageBuffer *msg = unsealed; msg != nullptr; msg = msg->next) {
+        // an empty payload always has the same checksum, written already
+        if (msg->size > MESSAGE_HEADER_SIZE) {
+            msgs.push_back(msg);
+        }
+    }
+    unsealed = nullptr;
+}
+
+void SendQueue::pop(MessagePool &pool)
+{
+    MessageBuffer *msg = head;
+    head = msg->next;
+    if (head == nullptr) {
+        tail = nullptr;
+    }
+    headPos = 0;
+    pool.release(msg);
+}
+
+void SendQueue::clear(MessagePool &pool)
+{
+    while (head != nullptr) {
+        pop(pool);
+    }
+    unsealed = nullptr;
+}
+
+bool SendQueue::flush(int sock, MessagePool &pool)
+{
+    struct iovec iov[SEND_IOV_MAX];
+    while (sendable()) {
+        int niov = 0;
+        size_t total = 0;
+        for (MessageBuffer *msg = head; msg != unsealed && niov < SEND_IOV_MAX; msg = msg->next) {
+            size_t offset = (msg == head) ? headPos : 0;
+            iov[niov].iov_base = msg->data + offset;
+            iov[niov].iov_len = msg->size - offset;
+            total += iov[niov].iov_len;
+            niov++;
         }
 
-        int wsize = write(sock, &buffer[0] + sendPos, bytesToSend);
+        ssize_t wsize = writev(sock, iov, niov);
         if (wsize < 0) {
-            if (errno != EWOULDBLOCK || errno != EINPROGRESS || errno != EINTR) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
                 printf("send buffer error: %s\n", strerror(errno));
                 return false;
             }
             break;
-        } else {
-            sendPos += wsize;
-            if (wsize != bytesToSend) {
-                // partial write
+        }
+
+        size_t left = wsize;
+        while (left > 0) {
+            size_t remain = head->size - headPos;
+            if (left < remain) {
+                headPos += left;
                 break;
-            } else {
-                sendPos = 0;
-                sendingBuffer.pop_front();
             }
+            left -= remain;
+            pop(pool);
+        }
+        if (static_cast<size_t>(wsize) < total) {
+            // partial write, the socket send buffer is full
+            break;
         }
     }
-    moreWrite = !sendingBuffer.empty();
     return true;
 }
 
-void Connection::processMessage(uint32_t version, CMessageHeader &header, const std::vector<unsigned char> &buffer, size_t offset)
+bool Connection::sendBuffer(bool &moreWrite)
+{
+    if (!sendQueue.flush(sock, *pool)) {
+        return false;
+    }
+    moreWrite = sendQueue.sendable();
+    return true;
+}
+
+void Connection::processMessage(MessageCommand command, const MessageSpan &payload)
+{
+    switch (command) {
+        case CMD_VERSION: {
+            CVectorReader(false, SER_NETWORK, 0, payload.data, payload.size, 0) >> youVersion >> youServices;
+            CVectorReader vreader(false, SER_NETWORK, youVersion, payload.data, payload.size, 0);
+            CVersionPayload versionPayload;
+            vreader >> versionPayload;
+            if (gReporter != nullptr) {
+                gReporter->reportVersionedAddr(addrYou.ToStringIP(), addrYou.GetPort(), versionPayload.user_agent, versionPayload.version, versionPayload.services);
+            }
+            printf("version command: addrme=%s, addryou=%s, agent=%s, version=%d, services=%lu\n",
+                versionPayload.addrMe.ToString().c_str(), addrYou.ToString().c_str(), versionPayload.user_agent.c_str(),
+                versionPayload.version, versionPayload.services);
+            // BIP155: ask for addrv2 between version and verack
+            if (youVersion >= ADDRV2_VERSION && myVersion >= ADDRV2_VERSION) {
+                pushSendaddrv2Command();
+            }
+            pushVerackCommand();
+            break;
+        }
+        case CMD_VERACK:
+            status = ESTABLISHED;
+            break;
+        case CMD_PING: {
+            uint64_t nonce;
+            CVectorReader(false, SER_NETWORK, youVersion, payload.data, payload.size, 0) >> nonce;
+            pushPongCommand(nonce);
+            break;
+        }
+        default:
+            // not needed for crawling
+            break;
+    }
+}
+
+void Connection::processAddr(const CService *addrs, size_t nAddrs, uint64_t nRecords)
 {
-    std::string command(header.command);
-    CVectorReader tmpVreader(false, SER_NETWORK, 0, buffer, offset+MESSAGE_HEADER_SIZE);
-    if (command == "version") {
-        tmpVreader >> youVersion >> youServices;
-        CVectorReader vreader(false, SER_NETWORK, youVersion, buffer, offset+MESSAGE_HEADER_SIZE);
-        CVersionPayload payload;
-        vreader >> payload;
-        if (gReporter != nullptr) {
-            gReporter->reportVersionedAddr(addrYou.ToStringIP(), addrYou.GetPort(), payload.user_agent, payload.version, payload.services);
+    for (size_t i = 0; i < nAddrs; ++i) {
+        printf("got new address from %s: %s\n", addrYou.ToString().c_str(), addrs[i].ToString().c_str());
+    }
+    nNewAddr += CAddrSeed::getInstance().addNewAddrs(addrs, nAddrs);
+    nAddrReceived += nRecords;
+    if (getaddrSent && nRecords > 1) {
+        // unsolicited gossip relays one address at a time, a larger batch
+        // is our answer; a full one may be followed by more
+        lastAddr = lastActive;
+        if (nRecords < MAX_ADDR_PER_MESSAGE) {
+            retire = true;
         }
-        printf("version command: addrme=%s, addryou=%s, agent=%s, version=%d, services=%lu\n",
-            payload.addrMe.ToString().c_str(), addrYou.ToString().c_str(), payload.user_agent.c_str(),
-            payload.version, payload.services);
-        pushVerackCommand();
-    } else if (command == "ping") {
-        uint64_t nonce;
-        tmpVreader >> nonce;
-        pushPongCommand(nonce);
-    } else if (command == "addr") {
-        CVectorReader vreader(true, SER_NETWORK, version, buffer, offset+MESSAGE_HEADER_SIZE);
-        uint32_t count = ReadVarInt<CVectorReader, VarIntMode::DEFAULT, uint32_t>(vreader);
-        CAddress addr;
-        for (auto i = 0; i < count; ++i) {
-            // assume valid
-            vreader >> addr;
-            printf("got new address from %s: %s\n", addrYou.ToString().c_str(), addr.ToString().c_str());
-            CAddrSeed::getInstance().addNewAddr(addr);
+    }
+}
+
+void RecvRing::resize(size_t capacity)
+{
+    std::vector<unsigned char> bigger(capacity);
+    peek(0, bigger.data(), used);
+    buffer.swap(bigger);
+    head = 0;
+}
+
+void RecvRing::reserve(size_t n)
+{
+    if (n <= buffer.size()) {
+        return;
+    }
+    size_t capacity = buffer.empty() ? RECV_RING_MIN : buffer.size();
+    while (capacity < n) {
+        capacity *= 2;
+    }
+    resize(capacity);
+}
+
+ssize_t RecvRing::fill(int sock, bool &drained)
+{
+    reserve(RECV_RING_MIN);
+    size_t capacity = buffer.size();
+    size_t tail = (head + used) & (capacity - 1);
+    struct iovec iov[2];
+    int niov = 0;
+    if (used == 0 || tail >= head) {
+        iov[niov].iov_base = &buffer[tail];
+        iov[niov].iov_len = capacity - tail;
+        niov++;
+        if (head > 0) {
+            iov[niov].iov_base = &buffer[0];
+            iov[niov].iov_len = head;
+            niov++;
         }
+    } else {
+        iov[niov].iov_base = &buffer[tail];
+        iov[niov].iov_len = head - tail;
+        niov++;
+    }
+    size_t room = capacity - used;
+    if (room == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    ssize_t nread = readv(sock, iov, niov);
+    if (nread > 0) {
+        used += nread;
+    }
+    drained = nread >= 0 && static_cast<size_t>(nread) < room;
+    return nread;
+}
 
+void RecvRing::peek(size_t offset, unsigned char *out, size_t n) const
+{
+    if (n == 0) {
+        return;
+    }
+    size_t capacity = buffer.size();
+    size_t start = (head + offset) & (capacity - 1);
+    size_t first = std::min(n, capacity - start);
+    memcpy(out, &buffer[start], first);
+    if (first < n) {
+        memcpy(out + first, &buffer[0], n - first);
     }
 }
 
-bool Connection::readBuffer(uint32_t version)
+const unsigned char *RecvRing::view(size_t offset, size_t n, std::vector<unsigned char> &scratch) const
 {
-    unsigned char tmpBuffer[16 * 1024];
-    int nread = read(sock, tmpBuffer, sizeof(tmpBuffer));
-    if (nread == 0) {
-        // peer close
-        printf("peer %s closed connection\n", addrYou.ToString().c_str());
-        return false;
-    } else if (nread < 0) {
-        if (errno != EWOULDBLOCK || errno != EINPROGRESS || errno != EINTR) {
-            printf("read error %d:%s\n", errno, strerror(errno));
+    if (n == 0) {
+        return nullptr;
+    }
+    size_t start = (head + offset) & (buffer.size() - 1);
+    if (start + n <= buffer.size()) {
+        return &buffer[start];
+    }
+    scratch.resize(n);
+    peek(offset, scratch.data(), n);
+    return scratch.data();
+}
+
+void RecvRing::consume(size_t n)
+{
+    head = (head + n) & (buffer.size() - 1);
+    used -= n;
+    if (used == 0) {
+        head = 0;
+        if (buffer.size() > RECV_RING_MIN) {
+            // give back the room a large message needed
+            std::vector<unsigned char>(RECV_RING_MIN).swap(buffer);
+        }
+    }
+}
+
+bool Connection::readBuffer(std::vector<InboundFrame> &frames)
+{
+    readPending = false;
+    // drain the socket: with edge-triggered events there is no second
+    // notification for data that is already queued
+    while (true) {
+        bool drained = false;
+        ssize_t nread = recvRing.fill(sock, drained);
+        if (nread == 0) {
+            // peer close
+            printf("peer %s closed connection\n", addrYou.ToString().c_str());
+            return false;
+        } else if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS) {
+                // the ring is full of framed messages, read on once the
+                // batch they are in has been processed
+                readPending = true;
+                return true;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("read error %d:%s\n", errno, strerror(errno));
+                return false;
+            }
+            return true;
+        }
+
+        if (!parseBuffer(frames)) {
             return false;
         }
-        return true;
+        if (drained) {
+            // short read, the socket receive queue is empty
+            return true;
+        }
     }
-    
-    vReadBuffer.insert(vReadBuffer.end(), tmpBuffer, tmpBuffer + nread);
-    size_t offset = 0;
-    CVectorReader vreader(false, SER_NETWORK, version, vReadBuffer, 0);
-    while (vReadBuffer.size() >= offset + MESSAGE_HEADER_SIZE) {
-       
+}
+
+void Connection::release(size_t n)
+{
+    if (framedBytes == 0) {
+        recvRing.consume(n);
+    } else {
+        // behind messages still waiting for their batch, freed with them
+        framedBytes += n;
+    }
+}
+
+bool Connection::parseBuffer(std::vector<InboundFrame> &frames)
+{
+    while (true) {
+        size_t avail = recvRing.size() - framedBytes;
+        if (skipBytes > 0) {
+            size_t n = std::min<size_t>(avail, skipBytes);
+            if (n == 0) {
+                break;
+            }
+            release(n);
+            skipBytes -= n;
+            continue;
+        }
+        if (addrStream.active) {
+            if (!streamAddr(frames)) {
+                return false;
+            }
+            if (addrStream.active) {
+                // waiting for more of it
+                break;
+            }
+            continue;
+        }
+        if (avail < MESSAGE_HEADER_SIZE) {
+            break;
+        }
         if (!headerValid) {
-            headerValid = true;
-            vreader >> header;
+            unsigned char raw[MESSAGE_HEADER_SIZE];
+            recvRing.peek(framedBytes, raw, sizeof(raw));
+            decodeHeader(raw, header);
             if (header.magic != MAIN_MAGIC) {
                 // printf("Invalid magic in header from %s: %#x\n", addrYou.ToString().c_str(), header.magic);
                 return false;
             }
-        } else {
-            vreader.skip(MESSAGE_HEADER_SIZE);
+            command = decodeCommand(header.command);
+            CommandPolicy policy = commandPolicy(command);
+            if (header.payloadLength > policy.maxLength) {
+                printf("oversized %.12s message from %s: %u bytes\n", header.command, addrYou.ToString().c_str(), header.payloadLength);
+                return false;
+            }
+            if (policy.mode == PAYLOAD_SKIP) {
+                // no need to hold or verify what we are not going to read
+                release(MESSAGE_HEADER_SIZE);
+                skipBytes = header.payloadLength;
+                continue;
+            }
+            if (policy.mode == PAYLOAD_STREAM) {
+                release(MESSAGE_HEADER_SIZE);
+                addrStream = AddrStream();
+                addrStream.active = true;
+                addrStream.remaining = header.payloadLength;
+                addrStream.first = readyAddrs.size();
+                continue;
+            }
+            headerValid = true;
         }
-        
-        if (vReadBuffer.size() < header.payloadLength + MESSAGE_HEADER_SIZE + offset) {
+
+        size_t messageSize = MESSAGE_HEADER_SIZE + header.payloadLength;
+        if (avail < messageSize) {
+            recvRing.reserve(framedBytes + messageSize);
             break;
         }
-        processMessage(version, header, vReadBuffer, offset);
+        if (command == CMD_VERSION && header.payloadLength >= 4) {
+            unsigned char raw[4];
+            recvRing.peek(framedBytes + MESSAGE_HEADER_SIZE, raw, sizeof(raw));
+            uint32_t word;
+            memcpy(&word, raw, sizeof(word));
+            framedVersion = le32toh(word);
+        }
+        InboundFrame frame;
+        frame.conn = this;
+        frame.header = header;
+        frame.command = command;
+        frame.streamed = false;
+        frame.offset = framedBytes + MESSAGE_HEADER_SIZE;
+        frame.nAddrs = 0;
+        frame.nRecords = 0;
+        frames.push_back(frame);
+        framedBytes += messageSize;
         headerValid = false;
-        offset += header.payloadLength + MESSAGE_HEADER_SIZE;
-        vreader.skip(header.payloadLength);
     }
-    if (offset > 0) {
-        size_t leftSize = vReadBuffer.size() - offset;
-        memcpy(&vReadBuffer[0], &vReadBuffer[offset], leftSize);
-        vReadBuffer.resize(leftSize);
+    return true;
+}
+
+bool Connection::streamAddr(std::vector<InboundFrame> &frames)
+{
+    static thread_local AddrBatch batch;
+    // whole records are taken out of the ring, a partial one waits there
+    static const size_t STREAM_CHUNK_RECORDS = 64;
+    unsigned char chunk[STREAM_CHUNK_RECORDS * ADDR_RECORD_SIZE];
+    static_assert(sizeof(chunk) >= MAX_ADDRV2_RECORD_SIZE, "an addrv2 record must fit a chunk");
+    AddrStream &stream = addrStream;
+    size_t recordSize = addrRecordSize(framedVersion);
+
+    if (!stream.counted) {
+        unsigned char raw[9];
+        size_t n = std::min<size_t>(std::min<size_t>(recvRing.size() - framedBytes, stream.remaining), sizeof(raw));
+        recvRing.peek(framedBytes, raw, n);
+        size_t len = decodeCompactSize(raw, n, stream.count);
+        if (len == 0) {
+            if (n == stream.remaining) {
+                printf("bad addr message from %s: no count\n", addrYou.ToString().c_str());
+                return false;
+            }
+            return true;
+        }
+        // addrv2 records vary in size, a short one is found when it is decoded
+        if (stream.count > MAX_ADDR_PER_MESSAGE || (command != CMD_ADDRV2 && stream.count * recordSize > stream.remaining - len)) {
+            printf("bad addr message from %s: %lu entries in %u bytes\n", addrYou.ToString().c_str(), stream.count, header.payloadLength);
+            return false;
+        }
+        stream.hasher.Write(raw, len);
+        release(len);
+        stream.remaining -= len;
+        stream.counted = true;
+    }
+
+    while (command == CMD_ADDRV2 && stream.decoded < stream.count) {
+        // the chunk holds the largest record, so a record that does not
+        // decode from a full chunk is only waiting for more bytes
+        size_t avail = std::min<size_t>(std::min<size_t>(recvRing.size() - framedBytes, stream.remaining), sizeof(chunk));
+        recvRing.peek(framedBytes, chunk, avail);
+        size_t pos = 0;
+        while (stream.decoded < stream.count) {
+            size_t len;
+            CService addr;
+            bool usable;
+            if (!decodeAddrV2Record(chunk + pos, avail - pos, len, addr, usable)) {
+                printf("bad addrv2 message from %s\n", addrYou.ToString().c_str());
+                return false;
+            }
+            if (len == 0) {
+                break;
+            }
+            if (usable) {
+                readyAddrs.push_back(addr);
+            }
+            pos += len;
+            stream.decoded++;
+        }
+        if (pos == 0) {
+            if (avail == stream.remaining) {
+                printf("bad addrv2 message from %s: %lu of %lu entries\n", addrYou.ToString().c_str(), stream.decoded, stream.count);
+                return false;
+            }
+            return true;
+        }
+        stream.hasher.Write(chunk, pos);
+        release(pos);
+        stream.remaining -= pos;
     }
+    while (stream.decoded < stream.count) {
+        size_t n = std::min<uint64_t>((recvRing.size() - framedBytes) / recordSize, stream.count - stream.decoded);
+        n = std::min(n, STREAM_CHUNK_RECORDS);
+        if (n == 0) {
+            return true;
+        }
+        size_t bytes = n * recordSize;
+        recvRing.peek(framedBytes, chunk, bytes);
+        stream.hasher.Write(chunk, bytes);
+        release(bytes);
+        stream.remaining -= bytes;
+        stream.decoded += n;
+        decodeAddrRecords(chunk, n, recordSize == ADDR_RECORD_SIZE, batch);
+        for (size_t i = 0; i < n; ++i) {
+            if (!batch.valid[i]) {
+                continue;
+            }
+            struct in6_addr ip;
+            memcpy(&ip, batch.ip[i], sizeof(ip));
+            readyAddrs.emplace_back(ip, batch.port[i]);
+        }
+    }
+    // anything after the records is hashed and dropped
+    while (stream.remaining > 0) {
+        size_t n = std::min<size_t>(std::min<size_t>(recvRing.size() - framedBytes, stream.remaining), sizeof(chunk));
+        if (n == 0) {
+            return true;
+        }
+        recvRing.peek(framedBytes, chunk, n);
+        stream.hasher.Write(chunk, n);
+        release(n);
+        stream.remaining -= n;
+    }
+
+    stream.active = false;
+    unsigned char hash[SHA256_OUTPUT_SIZE];
+    stream.hasher.Finalize(hash);
+    CSHA256().Write(hash, sizeof(hash)).Finalize(hash);
+    if (memcmp(hash, &header.checksum, sizeof(header.checksum)) != 0) {
+        // nothing of it is committed
+        printf("bad checksum on %.12s message from %s\n", header.command, addrYou.ToString().c_str());
+        readyAddrs.resize(stream.first);
+        return true;
+    }
+    InboundFrame frame;
+    frame.conn = this;
+    frame.header = header;
+    frame.command = CMD_ADDR;
+    frame.streamed = true;
+    frame.offset = stream.first;
+    frame.nAddrs = readyAddrs.size() - stream.first;
+    frame.nRecords = stream.count;
+    frames.push_back(frame);
     return true;
 }
 
-bool Connection::pushCommand()
+bool Connection::pushCommand(MessageBuffer *msg)
 {
-    sendingBuffer.push_back(std::move(vSendBuffer));
+    sendQueue.push(msg);
     return true;
 }
 
-bool Connection::pushVersionCommand(uint32_t version)
-{
-    vSendBuffer.clear();
-    vSendBuffer.resize(MESSAGE_HEADER_SIZE);
-    CVersionPayload versionPayload;
-    versionPayload.version = version;
-    versionPayload.services = static_cast<uint64_t>(NODE_NETWORK);
-    versionPayload.timestamp = time(nullptr);
-    versionPayload.addrMe = CAddress(addrMe, version, versionPayload.timestamp);
-    versionPayload.addrYou = CAddress(addrYou, version, versionPayload.timestamp);
-    versionPayload.nonce = versionPayload.timestamp;
-    versionPayload.user_agent = "/Satoshi:0.14.2/";
-    versionPayload.start_height = 0;
-    versionPayload.relay = false;
-    CVectorWriter{false, SER_NETWORK, version, vSendBuffer, MESSAGE_HEADER_SIZE, versionPayload};
-    unsigned char hash[32];
-    dsha256(&vSendBuffer[MESSAGE_HEADER_SIZE], vSendBuffer.size() - MESSAGE_HEADER_SIZE, hash);
-    CMessageHeader hdr(MAIN_MAGIC, "version", vSendBuffer.size() - MESSAGE_HEADER_SIZE, hash);
-    CVectorWriter{false, SER_NETWORK, version, vSendBuffer, 0, hdr};
-    
-    return pushCommand();
+bool Connection::pushVersionCommand(const VersionTemplate &versionTemplate)
+{
+    MessageBuffer *msg = pool->alloc();
+    int64_t timestamp = time(nullptr);
+    // the checksum is filled in when the send queue is sealed
+    versionTemplate.build(msg, timestamp, timestamp, addrMe, addrYou);
+    myVersion = versionTemplate.getVersion();
+    return pushCommand(msg);
 }
 
 bool Connection::pushPongCommand(uint64_t nonce)
 {
-    vSendBuffer.resize(0);
-    CVectorWriter{false, SER_NETWORK, 0, vSendBuffer, MESSAGE_HEADER_SIZE, nonce};
-    unsigned char hash[32];
-    dsha256(&vSendBuffer[MESSAGE_HEADER_SIZE], vSendBuffer.size() - MESSAGE_HEADER_SIZE, hash);
-    CMessageHeader hdr(MAIN_MAGIC, "pong", vSendBuffer.size() - MESSAGE_HEADER_SIZE, hash);
-    CVectorWriter{false, SER_NETWORK, 0, vSendBuffer, 0, hdr};
-    return pushCommand();
+    MessageBuffer *msg = pool->alloc();
+    memcpy(msg->data, PONG_HEADER, MESSAGE_HEADER_SIZE);
+    CBufferWriter writer(false, SER_NETWORK, 0, msg->data, sizeof(msg->data), MESSAGE_HEADER_SIZE, nonce);
+    msg->size = writer.GetPos();
+    return pushCommand(msg);
 }
 
 bool Connection::initializeAddress()
 {
     assert(sock > 0);
-    struct sockaddr sa;
+    // large enough for both families
+    struct sockaddr_storage sa;
     memset(&sa, 0, sizeof(sa));
     socklen_t slen = sizeof(sa);
     // ignore error
-    getsockname(sock, &sa, &slen);
-    addrMe = CService(&sa);
+    getsockname(sock, reinterpret_cast<struct sockaddr *>(&sa), &slen);
+    addrMe = CService(reinterpret_cast<struct sockaddr *>(&sa));
     memset(&sa, 0, sizeof(sa));
-    getpeername(sock, &sa, &slen);
-    addrYou = CService(&sa);
+    slen = sizeof(sa);
+    getpeername(sock, reinterpret_cast<struct sockaddr *>(&sa), &slen);
+    addrYou = CService(reinterpret_cast<struct sockaddr *>(&sa));
     return true;
 }
 
 bool Connection::pushVerackCommand()
 {
-    vSendBuffer.clear();
-    unsigned char hash[32];
-    const unsigned char p[] = "";
-    dsha256(p, 0, hash);
-    CMessageHeader hdr(MAIN_MAGIC, "verack", 0, hash);
-    CVectorWriter{false, SER_NETWORK, 0, vSendBuffer, 0, hdr};
-    
-    return pushCommand();
+    MessageBuffer *msg = pool->alloc();
+    memcpy(msg->data, VERACK_MESSAGE, MESSAGE_HEADER_SIZE);
+    msg->size = MESSAGE_HEADER_SIZE;
+    return pushCommand(msg);
+}
+
+bool Connection::pushSendaddrv2Command()
+{
+    MessageBuffer *msg = pool->alloc();
+    memcpy(msg->data, SENDADDRV2_MESSAGE, MESSAGE_HEADER_SIZE);
+    msg->size = MESSAGE_HEADER_SIZE;
+    return pushCommand(msg);
 }
 
-NetworkCallback *ConnectionManager::initiateConnection(const CService &saddr, int &sock)
+bool Connection::pushGetaddrCommand()
 {
-    struct sockaddr addr;
+    MessageBuffer *msg = pool->alloc();
+    memcpy(msg->data, GETADDR_MESSAGE, MESSAGE_HEADER_SIZE);
+    msg->size = MESSAGE_HEADER_SIZE;
+    return pushCommand(msg);
+}
+
+ConnectionSlot *ConnectionManager::initiateConnection(const CService &saddr, int &sock)
+{
+    struct sockaddr_storage addr;
     socklen_t addrlen = sizeof(addr);
     printf("initiate connection to %s\n", saddr.ToString().c_str());
-    saddr.GetSockAddr(&addr, &addrlen);
-    sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (!saddr.GetSockAddr(reinterpret_cast<struct sockaddr *>(&addr), &addrlen)) {
+        sock = -1;
+        errno = EAFNOSUPPORT;
+        return nullptr;
+    }
+    sock = socket(addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
     if (sock < 0) {
         return nullptr;
     }
+    if (!mOptions.sourceAddrs.empty() && !bindSource(sock, saddr)) {
+        int err = errno;
+        close(sock);
+        sock = -1;
+        errno = err;
+        return nullptr;
+    }
 
-    Connection &con = *addConnection(saddr, sock);
+    ConnectionSlot *slot = addConnection(saddr, sock);
+    if (slot == nullptr) {
+        close(sock);
+        sock = -1;
+        return nullptr;
+    }
+    Connection &con = slot->conn;
 
     int flag = fcntl(sock, F_GETFL, 0);
 	if ( -1 == flag ) {
-        close(sock);
+        closeConnection(sock);
         sock = -1;
 		return nullptr;
 	}
@@ -231,18 +635,23 @@ NetworkCallback *ConnectionManager::initiateConnection(const CService &saddr, in
     int on = 1;
     int ret = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
     if (-1 == ret) {
-        close(sock);
+        closeConnection(sock);
         sock = -1;
         return nullptr;
     }
-    ret = connect(sock, &addr, sizeof(addr));
+    // only a connect that actually goes out spends connect budget
+    connects.onAttempt();
+    ret = connect(sock, reinterpret_cast<struct sockaddr *>(&addr), addrlen);
     if (ret == -1) {
         int err = errno;
         if (err == EINPROGRESS || err == EWOULDBLOCK) {
             // connecting
             con.status = CONNECTING;
+            con.inFlight = true;
+            nConnecting++;
         } else {
-            close(sock);
+            connectFailed(con, err);
+            closeConnection(sock);
             sock = -1;
             return nullptr;
         }
@@ -250,69 +659,397 @@ NetworkCallback *ConnectionManager::initiateConnection(const CService &saddr, in
         con.initializeAddress();
         con.status = CONNECTED;
     }
-    auto cb = std::bind(&ConnectionManager::networkCallback, this, sock,
-        std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
-    callbacks[sock] = cb;
-    qSocks.push_back(sock);
-    return &callbacks[sock];
+    con.lastActive = mNow;
+    con.connectStart = mNow;
+    con.timer.ud = &con;
+    armTimer(con);
+    con.evictNode.ud = slot;
+    evictions.update(&con.evictNode, evictionScore(con));
+    return slot;
 }
 
-Connection *ConnectionManager::addConnection(const CService &addr, int sock)
+ConnectionSlot *ConnectionManager::addConnection(const CService &addr, int sock)
 {
-    if (sock < 0) {
+    ConnectionSlot *slot = slab.slot(sock);
+    if (slot == nullptr) {
         return nullptr;
     }
-    Connection con(sock, addr);
-    connections[sock] = con;
-    return &connections[sock];
+    slot->conn = Connection(sock, addr, &messagePool);
+    slot->inUse = true;
+    slot->writeEnabled = false;
+    nConnections++;
+    return slot;
+}
+
+bool ConnectionManager::bindSource(int sock, const CService &addr)
+{
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    // let connect() pick the port, so that the same local port can be
+    // reused towards different destinations instead of one per socket
+    int on = 1;
+    setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+#endif
+    size_t nSources = mOptions.sourceAddrs.size();
+    bool sameFamily = false;
+    int err = 0;
+    for (size_t i = 0; i < nSources; ++i) {
+        const CService &source = mOptions.sourceAddrs[nextSource];
+        nextSource = (nextSource + 1) % nSources;
+        if (source.IsIPv4() != addr.IsIPv4()) {
+            continue;
+        }
+        sameFamily = true;
+        struct sockaddr_storage local;
+        socklen_t locallen = sizeof(local);
+        if (!source.GetSockAddr(reinterpret_cast<struct sockaddr *>(&local), &locallen)) {
+            continue;
+        }
+        if (bind(sock, reinterpret_cast<struct sockaddr *>(&local), locallen) == 0) {
+            return true;
+        }
+        err = errno;
+        printf("bind to %s failed: %s\n", source.ToStringIP().c_str(), strerror(err));
+    }
+    if (!sameFamily) {
+        // no -bind address of this family, leave the choice to the kernel
+        return true;
+    }
+    errno = err != 0 ? err : EADDRNOTAVAIL;
+    return false;
+}
+
+void ConnectionManager::connectFailed(const Connection &conn, int err)
+{
+    switch (err) {
+        case ECONNREFUSED:
+            CAddrSeed::getInstance().addRefusedAddr(conn.addrYou);
+            connects.onFailure();
+            break;
+        case ETIMEDOUT:
+        case EHOSTUNREACH:
+            connects.onFailure();
+            break;
+        default:
+            // local trouble such as EMFILE, or ENETUNREACH for a family this
+            // host has no route for, says nothing about the path
+            break;
+    }
+}
+
+int64_t ConnectionManager::evictionScore(const Connection &conn) const
+{
+    int64_t score = conn.lastActive;
+    score -= static_cast<int64_t>(conn.lastActive - conn.connectStart) / EVICT_AGE_DIVISOR;
+    if (conn.status == ESTABLISHED) {
+        score += 2 * EVICT_STATUS_TIER;
+    } else if (conn.status > CONNECTING) {
+        score += EVICT_STATUS_TIER;
+    }
+    score += std::min(conn.nNewAddr * EVICT_NEW_ADDR_MS, EVICT_NEW_ADDR_CAP_MS);
+    if (conn.nAddrReceived > 0) {
+        score += EVICT_NOVELTY_MS * conn.nNewAddr / conn.nAddrReceived;
+    }
+    return score;
 }
 
 int ConnectionManager::evictSock()
 {
-    if (!qSocks.empty()) {
-        int sock = qSocks.front();
-        qSocks.pop_front();
-        return sock;
+    EvictionNode *node = evictions.top();
+    if (node == nullptr) {
+        return -1;
+    }
+    return reinterpret_cast<ConnectionSlot *>(node->ud)->conn.sock;
+}
+
+void ConnectionManager::armTimer(Connection &conn)
+{
+    uint64_t expire;
+    switch (conn.status) {
+        case CONNECTING:
+            expire = mNow + CONNECT_TIMEOUT_MS;
+            break;
+        case ESTABLISHED:
+            if (conn.getaddrSent) {
+                expire = conn.lastAddr + GETADDR_QUIET_MS;
+            } else {
+                expire = conn.lastActive + IDLE_TIMEOUT_MS;
+            }
+            break;
+        default:
+            expire = mNow + HANDSHAKE_TIMEOUT_MS;
+            break;
+    }
+    timers.add(&conn.timer, expire);
+}
+
+void ConnectionManager::expireTimers(uint64_t now, std::vector<int> &timedOut)
+{
+    mNow = now;
+    vExpired.clear();
+    timers.advance(now, vExpired);
+    for (auto node: vExpired) {
+        Connection &conn = *reinterpret_cast<Connection *>(node->ud);
+        if (conn.status == ESTABLISHED && conn.getaddrSent) {
+            if (conn.lastAddr + GETADDR_QUIET_MS > now) {
+                armTimer(conn);
+                continue;
+            }
+            // the peer went quiet, take what it sent and free the fd
+            printf("crawl of %s done after quiet period, %u addresses\n", conn.addrYou.ToString().c_str(), conn.nAddrReceived);
+            timedOut.push_back(conn.sock);
+            continue;
+        }
+        if (conn.status == ESTABLISHED && conn.lastActive + IDLE_TIMEOUT_MS > now) {
+            // the idle deadline moves with every read, re-arm lazily
+            armTimer(conn);
+            continue;
+        }
+        printf("connection to %s timed out in state %d\n", conn.addrYou.ToString().c_str(), conn.status);
+        if (conn.status == CONNECTING) {
+            connects.onFailure();
+        }
+        CAddrSeed::getInstance().addTimeoutAddr(conn.addrYou);
+        timedOut.push_back(conn.sock);
+    }
+}
+
+void ConnectionManager::connectSettled(Connection &conn)
+{
+    if (conn.inFlight) {
+        conn.inFlight = false;
+        nConnecting--;
     }
-    return -1;
 }
 
 void ConnectionManager::closeConnection(int sock)
 {
-    if (connections.count(sock) <= 0) {
+    ConnectionSlot *slot = slab.slot(sock);
+    if (slot == nullptr || !slot->inUse) {
         return;
     }
-    connections.erase(sock);
-    callbacks.erase(sock);
+    connectSettled(slot->conn);
+    if (mOptions.rstClose) {
+        // abortive close, the peer gets a RST and we keep no TIME_WAIT
+        struct linger lin = {1, 0};
+        setsockopt(sock, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    }
+    timers.remove(&slot->conn.timer);
+    evictions.remove(&slot->conn.evictNode);
+    slot->conn.sendQueue.clear(messagePool);
+    // release the buffers, the slot itself stays for the next user of this fd
+    slot->conn = Connection();
+    slot->inUse = false;
+    slot->dirty = false;
+    slot->closing = false;
+    nConnections--;
     close(sock);
 }
 
-bool ConnectionManager::networkCallback(int sock, const struct event &event, int &rsock, bool &moreWrite)
+bool ConnectionManager::handleEvent(ConnectionSlot &slot, const struct event &event)
 {
-    Connection &conn = connections[sock];
-    rsock = sock;
+    Connection &conn = slot.conn;
+    if (!slot.dirty) {
+        slot.dirty = true;
+        slot.prevStatus = conn.status;
+        vDirty.push_back(&slot);
+    }
+    if (event.error) {
+        if (conn.status == CONNECTING) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(conn.sock, SOL_SOCKET, SO_ERROR, &err, &len);
+            connectFailed(conn, err);
+        }
+        slot.closing = true;
+        return false;
+    }
+    // an edge-triggered event may carry both directions, serve both
     if (event.write) {
         if (conn.status < CONNECTED) {
             printf("connection to %s success\n", conn.addrYou.ToString().c_str());
+            // settle here, a read failure in the same event closes the slot
+            // before afterEvents would see the status change
+            if (conn.inFlight) {
+                connects.onConnected(mNow - conn.connectStart);
+            }
+            connectSettled(conn);
             conn.initializeAddress();
             conn.status = VERSION_SENT;
-            conn.pushVersionCommand(mVersion);
+            conn.pushVersionCommand(versionTemplate);
         } else {
             if (conn.status == CONNECTED) {
-                conn.pushVersionCommand(mVersion);
+                conn.pushVersionCommand(versionTemplate);
                 conn.status = VERSION_SENT;
             }
         }
-        return conn.sendBuffer(moreWrite);
-    } else if (event.read) {
-        int ret = conn.readBuffer(conn.youVersion);
-        moreWrite = !conn.sendingBuffer.empty();
-        return ret;
-    } else if (event.error) {
+    }
+    if (event.read) {
+        conn.lastActive = mNow;
+        if (!conn.readBuffer(vInbound)) {
+            slot.closing = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+void ConnectionManager::processInbound()
+{
+    size_t n = vInbound.size();
+    // payloads that wrap around their ring are copied out side by side
+    size_t wrapped = 0;
+    for (auto &frame: vInbound) {
+        if (!frame.streamed && !frame.conn->recvRing.contiguous(frame.offset, frame.header.payloadLength)) {
+            wrapped += frame.header.payloadLength;
+        }
+    }
+    vWrapped.resize(wrapped);
+    vHashData.resize(n);
+    vHashLen.resize(n);
+    vHashes.resize(n * SHA256_OUTPUT_SIZE);
+    std::vector<unsigned char> unused;
+    wrapped = 0;
+    // streamed frames were verified already and are not hashed again
+    size_t nHash = 0;
+    for (auto &frame: vInbound) {
+        if (frame.streamed) {
+            continue;
+        }
+        RecvRing &ring = frame.conn->recvRing;
+        size_t length = frame.header.payloadLength;
+        if (length == 0 || ring.contiguous(frame.offset, length)) {
+            vHashData[nHash] = ring.view(frame.offset, length, unused);
+        } else {
+            ring.peek(frame.offset, &vWrapped[wrapped], length);
+            vHashData[nHash] = &vWrapped[wrapped];
+            wrapped += length;
+        }
+        vHashLen[nHash] = length;
+        nHash++;
+    }
+    unsigned char (*hashes)[SHA256_OUTPUT_SIZE] = reinterpret_cast<unsigned char (*)[SHA256_OUTPUT_SIZE]>(vHashes.data());
+    dsha256Many(vHashData.data(), vHashLen.data(), hashes, nHash);
+
+    size_t i = 0;
+    for (auto &frame: vInbound) {
+        Connection &conn = *frame.conn;
+        if (frame.streamed) {
+            conn.processAddr(conn.readyAddrs.data() + frame.offset, frame.nAddrs, frame.nRecords);
+            continue;
+        }
+        if (memcmp(hashes[i], &frame.header.checksum, sizeof(frame.header.checksum)) != 0) {
+            // a corrupted frame, drop it like bitcoind does
+            printf("bad checksum on %.12s message from %s\n", frame.header.command, conn.addrYou.ToString().c_str());
+        } else if (frame.command != CMD_UNKNOWN) {
+            conn.processMessage(frame.command, MessageSpan(vHashData[i], vHashLen[i]));
+        }
+        i++;
+    }
+    vInbound.clear();
+    for (auto slot: vDirty) {
+        Connection &conn = slot->conn;
+        if (conn.framedBytes > 0) {
+            conn.recvRing.consume(conn.framedBytes);
+            conn.framedBytes = 0;
+        }
+        // keep those of an addr still streaming in
+        size_t first = conn.addrStream.active ? conn.addrStream.first : conn.readyAddrs.size();
+        conn.readyAddrs.erase(conn.readyAddrs.begin(), conn.readyAddrs.begin() + first);
+        conn.addrStream.first = 0;
+    }
+}
+
+void ConnectionManager::afterEvents(ConnectionSlot &slot)
+{
+    Connection &conn = slot.conn;
+    ConnectionStatus oldStatus = slot.prevStatus;
+    if (conn.status == ESTABLISHED && oldStatus != ESTABLISHED && mOptions.crawl) {
+        conn.pushGetaddrCommand();
+        conn.getaddrSent = true;
+        conn.lastAddr = mNow;
+    }
+    if (conn.retire) {
+        printf("crawl of %s done, %u addresses\n", conn.addrYou.ToString().c_str(), conn.nAddrReceived);
+        slot.closing = true;
+        return;
+    }
+    if (conn.status != oldStatus) {
+        armTimer(conn);
+    }
+    evictions.update(&conn.evictNode, evictionScore(conn));
+}
+
+void ConnectionManager::sealOutbound()
+{
+    vOutbound.clear();
+    for (auto slot: vDirty) {
+        if (!slot->closing) {
+            slot->conn.sendQueue.seal(vOutbound);
+        }
+    }
+    size_t n = vOutbound.size();
+    if (n == 0) {
+        return;
+    }
+    vHashData.resize(n);
+    vHashLen.resize(n);
+    vHashes.resize(n * SHA256_OUTPUT_SIZE);
+    for (size_t i = 0; i < n; ++i) {
+        vHashData[i] = vOutbound[i]->data + MESSAGE_HEADER_SIZE;
+        vHashLen[i] = vOutbound[i]->size - MESSAGE_HEADER_SIZE;
+    }
+    unsigned char (*hashes)[SHA256_OUTPUT_SIZE] = reinterpret_cast<unsigned char (*)[SHA256_OUTPUT_SIZE]>(vHashes.data());
+    dsha256Many(vHashData.data(), vHashLen.data(), hashes, n);
+    for (size_t i = 0; i < n; ++i) {
+        // the checksum is the last field of the header
+        memcpy(vOutbound[i]->data + MESSAGE_HEADER_SIZE - 4, hashes[i], 4);
+    }
+}
+
+void ConnectionManager::finishEvents()
+{
+    while (!vInbound.empty()) {
+        processInbound();
+        // connections that stopped reading on a full ring go on now
+        for (auto slot: vDirty) {
+            Connection &conn = slot->conn;
+            if (!slot->closing && conn.readPending && !conn.readBuffer(vInbound)) {
+                slot->closing = true;
+            }
+        }
+    }
+    for (auto slot: vDirty) {
+        if (!slot->closing) {
+            afterEvents(*slot);
+        }
+    }
+    sealOutbound();
+}
+
+bool ConnectionManager::flushEvent(ConnectionSlot &slot, bool &moreWrite)
+{
+    if (slot.closing) {
         return false;
     }
-    return false;
+    // flush right away whatever the handlers queued, no writability edge
+    // may come for a socket whose send buffer never filled up
+    return slot.conn.sendBuffer(moreWrite);
+}
+
+void ConnectionManager::clearDirty()
+{
+    for (auto slot: vDirty) {
+        slot->dirty = false;
+        slot->closing = false;
+    }
+    vDirty.clear();
+}
 
+NetworkEngine::~NetworkEngine()
+{
+    if (sp != -1) {
+        sp_release(sp);
+    }
 }
 
 bool NetworkEngine::initEngine()
@@ -323,7 +1060,7 @@ bool NetworkEngine::initEngine()
     }
     int flag = fcntl(sp, F_GETFL, 0);
 	if ( -1 == flag ) {
-        close(sp);
+        sp_release(sp);
         sp = -1;
 		return false;
 	}
@@ -334,85 +1071,188 @@ bool NetworkEngine::initEngine()
         printf("getrlimit error");
         return false;
     }
-    maxConnections = limit.rlim_cur - 10;
+    // the fd limit is per process, so every shard gets an equal slice of it
+    maxConnections = (limit.rlim_cur - 10) / shardCount;
+    events.resize(SP_MAX_EVENTS);
+    if (maxConnections <= 0) {
+        printf("shard %d: not enough file descriptors for %d shards\n", shardId, shardCount);
+        return false;
+    }
     return true;
 }
 
 void NetworkEngine::startEngine()
 {
-    std::vector<CService *> addrs;
+    std::vector<CService> addrs;
     addrs.reserve(DRAIN_SEED_SIZE_PER_LOOP);
     size_t newSize;
     while (true) {
-        newSize = DRAIN_SEED_SIZE_PER_LOOP;
+        timedOut.resize(0);
+        connMan.expireTimers(monotonicMs(), timedOut);
+        for (auto sock: timedOut) {
+            sp_del(sp, sock);
+            connMan.closeConnection(sock);
+        }
+
+        // the connect controller decides how many connects may start now
+        size_t allowance = connMan.connectAllowance();
+        newSize = std::min<size_t>(DRAIN_SEED_SIZE_PER_LOOP, allowance);
         addrs.resize(0);
-        CAddrSeed::getInstance().getNewAddrs(addrs, newSize, false);
-        for (auto paddr: addrs) {
+        if (newSize > 0) {
+            // an idle shard blocks until new addresses arrive instead of spinning
+            bool wait = connMan.connectionCount() == 0;
+            CAddrSeed::getInstance().getNewAddrs(addrs, newSize, wait);
+            // deadlines of the connects below start now, not before the wait
+            connMan.setNow(monotonicMs());
+        }
+        if (allowance == 0 || (allowance < DRAIN_SEED_SIZE_PER_LOOP && addrs.size() == allowance)) {
+            connMan.connectLimited();
+        }
+        for (const CService &addr: addrs) {
             int sock = -1;
             if (connMan.connectionCount() >= maxConnections) {
                 int esock = connMan.evictSock();
                 if (esock > 0) {
                     sp_del(sp, esock);
-                    nPendingEvents--;
                     connMan.closeConnection(esock);
                 }
             }
-            auto pCallback = connMan.initiateConnection(*paddr, sock);
+            ConnectionSlot *slot = connMan.initiateConnection(addr, sock);
             if (sock < 0) {
-                printf("initiate connection to %s failed: %s\n", paddr->ToString().c_str(), strerror(errno));
+                printf("initiate connection to %s failed: %s\n", addr.ToString().c_str(), strerror(errno));
                 continue;
             }
-            int ret = sp_add(sp, sock, reinterpret_cast<void *>(pCallback));
+            int ret = sp_add(sp, sock, reinterpret_cast<void *>(slot));
             if (ret < 0) {
-                printf("sp_add_write error: %s\n", strerror(errno));
+                printf("sp_add error: %s\n", strerror(errno));
                 sp_del(sp, sock);
-                nPendingEvents--;
                 connMan.closeConnection(sock);
                 continue;
             }
-           
-            writeEnabled[sock] = true;
+            slot->writeEnabled = true;
         }
-        nPendingEvents += newSize;
-        if (nPendingEvents > events.size()) {
-            events.resize(nPendingEvents);        }
-        int nActiveEvents = sp_wait(sp, &events[0], nPendingEvents, nullptr);
+        struct timespec timeout;
+        struct timespec *pTimeout = nullptr;
+        int timeoutMs = connMan.nextTimeoutMs();
+        int connectWaitMs = connMan.connectWaitMs();
+        if (connectWaitMs >= 0 && (timeoutMs < 0 || connectWaitMs < timeoutMs)) {
+            timeoutMs = connectWaitMs;
+        }
+        if (timeoutMs >= 0) {
+            timeout.tv_sec = timeoutMs / 1000;
+            timeout.tv_nsec = (timeoutMs % 1000) * 1000000;
+            pTimeout = &timeout;
+        }
+        int nActiveEvents = sp_wait(sp, &events[0], events.size(), pTimeout);
+        connMan.setNow(monotonicMs());
         dispatchNetworkEvents(nActiveEvents);
     }
 }
 
 void NetworkEngine::dispatchNetworkEvents(int nActiveEvents)
 {
-    std::vector<int> closeSocks;
     for (auto i = 0; i < nActiveEvents; ++i) {
         const struct event &event = events[i];
-        NetworkCallback *callback = reinterpret_cast<NetworkCallback *>(event.ud);
-        int sock;
+        ConnectionSlot *slot = reinterpret_cast<ConnectionSlot *>(event.ud);
+        connMan.handleEvent(*slot, event);
+    }
+    // verify, process and checksum in batches before anything is sent
+    connMan.finishEvents();
+
+    closeSocks.resize(0);
+    for (auto slot: connMan.dirtySlots()) {
+        int sock = slot->conn.sock;
         bool moreWrite;
-        if(!(*callback)(event, sock, moreWrite)) {
+        if (!connMan.flushEvent(*slot, moreWrite)) {
             sp_del(sp, sock);
             closeSocks.push_back(sock);
             continue;
         }
         if (moreWrite) {
-            if (!writeEnabled[sock]) {
-                int ret = sp_enable_write(sp, sock, reinterpret_cast<void *>(connMan.getNetworkCallback(sock)));
+            if (!slot->writeEnabled) {
+                int ret = sp_enable_write(sp, sock, reinterpret_cast<void *>(slot));
                 if (ret == -1) {
                     printf("sp_enable_write sock=%d failed: %s\n", sock, strerror(errno));
                 }
-                writeEnabled[sock] = true;
+                slot->writeEnabled = true;
             }
         } else {
-            if (writeEnabled[sock]) {
-                int ret = sp_disable_write(sp, sock, reinterpret_cast<void *>(connMan.getNetworkCallback(sock)));
+            if (slot->writeEnabled) {
+                int ret = sp_disable_write(sp, sock, reinterpret_cast<void *>(slot));
                 if (ret == -1) {
                     printf("sp_disable_write sock=%d failed\n", sock);
                 }
-                writeEnabled[sock] = false;
+                slot->writeEnabled = false;
             }
         }
     }
+    connMan.clearDirty();
     for (auto sock: closeSocks) {
         connMan.closeConnection(sock);
     }
-}
\ No newline at end of file
+}
+
+ConnectionSlab::ConnectionSlab(): nChunks(0)
+{
+    struct rlimit limit;
+    size_t maxFds = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        maxFds = limit.rlim_cur;
+    }
+    nChunks = (maxFds + SLAB_CHUNK_SIZE - 1) >> SLAB_CHUNK_BITS;
+    chunks.reset(new std::atomic<ConnectionSlot *>[nChunks]);
+    for (size_t i = 0; i < nChunks; ++i) {
+        chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+ConnectionSlab::~ConnectionSlab()
+{
+    for (size_t i = 0; i < nChunks; ++i) {
+        delete[] chunks[i].load(std::memory_order_relaxed);
+    }
+}
+
+ConnectionSlot *ConnectionSlab::allocChunk(size_t index)
+{
+    std::lock_guard<std::mutex> lock(chunkLock);
+    ConnectionSlot *chunk = chunks[index].load(std::memory_order_relaxed);
+    if (chunk == nullptr) {
+        chunk = new ConnectionSlot[SLAB_CHUNK_SIZE];
+        chunks[index].store(chunk, std::memory_order_release);
+    }
+    return chunk;
+}
+
+ShardedNetworkEngine::ShardedNetworkEngine(uint32_t version, int shardCount, const NetworkOptions &options)
+{
+    if (shardCount < 1) {
+        shardCount = 1;
+    }
+    for (auto i = 0; i < shardCount; ++i) {
+        engines.emplace_back(new NetworkEngine(version, slab, options, i, shardCount));
+    }
+}
+
+bool ShardedNetworkEngine::initEngine()
+{
+    for (auto &engine: engines) {
+        if (!engine->initEngine()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ShardedNetworkEngine::startEngine()
+{
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < engines.size(); ++i) {
+        threads.emplace_back(&NetworkEngine::startEngine, engines[i].get());
+    }
+    // shard 0 runs on the calling thread
+    engines[0]->startEngine();
+    for (auto &t: threads) {
+        t.join();
+    }
+}
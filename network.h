@@ -1,17 +1,22 @@
 #ifndef __NETWORK_H__
 #define __NETWORK_H__
 #include "message.h"
+#include "timer.h"
+#include "eviction.h"
+#include "connrate.h"
+#include "sha256.h"
 
 #include <bitcoin/protocol.h>
 
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <vector>
-#include <list>
-#include <queue>
-#include <map>
-#include <functional>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 
 struct event {
@@ -21,13 +26,39 @@ struct event {
 	bool error;
 };
 
-#if defined(__linux__)
+// upper bound of events harvested by one sp_wait call
+static const int SP_MAX_EVENTS = 512;
+
+#if defined(__linux__) && defined(USE_IO_URING)
+// io_uring backend, implemented in sp_uring.cpp
+int sp_create(size_t);
+void sp_release(int efd);
+void sp_del(int efd, int sock);
+int sp_add(int efd, int sock, void *ud);
+int sp_add_read(int efd, int sock, void *ud);
+int sp_add_write(int efd, int sock, void *ud);
+int sp_enable_write(int efd, int sock, void *ud);
+int sp_disable_write(int efd, int sock, void *ud);
+int sp_wait(int efd, struct event *e, int max, const timespec *timeout);
+
+#elif defined(__linux__)
 #include <sys/epoll.h>
-
+#include <unistd.h>
+
+/*
+ * Sockets are registered edge-triggered for both directions once, so the
+ * writability of an idle connected socket does not wake the loop again
+ * and again. Callers must drain reads and writes until EAGAIN; in return
+ * sp_enable_write/sp_disable_write have nothing to do.
+ */
 static int sp_create(size_t) {
 	return epoll_create(1024);
 }
 
+static void sp_release(int efd) {
+	close(efd);
+}
+
 static void 
 sp_del(int efd, int sock) {
 	epoll_ctl(efd, EPOLL_CTL_DEL, sock , NULL);
@@ -35,7 +66,7 @@ sp_del(int efd, int sock) {
 
 static int sp_add(int efd, int sock, void *ud) {
 	struct epoll_event ev;
-	ev.events = EPOLLIN | EPOLLOUT;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
 	ev.data.ptr = ud;
 	if (epoll_ctl(efd, EPOLL_CTL_ADD, sock, &ev) == -1) {
 		return -1;
@@ -45,7 +76,7 @@ static int sp_add(int efd, int sock, void *ud) {
 
 static int sp_add_read(int efd, int sock, void *ud) {
 	struct epoll_event ev;
-	ev.events = EPOLLIN;
+	ev.events = EPOLLIN | EPOLLET;
 	ev.data.ptr = ud;
 	if (epoll_ctl(efd, EPOLL_CTL_ADD, sock, &ev) == -1) {
 		return -1;
@@ -54,39 +85,28 @@ static int sp_add_read(int efd, int sock, void *ud) {
 }
 
 static int sp_add_write(int efd, int sock, void *ud) {
-	struct epoll_event ev;
-	ev.events = EPOLLOUT | EPOLLIN;
-	ev.data.ptr = ud;
-	if (epoll_ctl(efd, EPOLL_CTL_ADD, sock, &ev) == -1) {
-		return -1;
-	}
-	return 0;
+	return sp_add(efd, sock, ud);
 }
 
-static int sp_enable_write(int efd, int sock, void *ud) {
-	struct epoll_event ev;
-	ev.events = EPOLLOUT | EPOLLIN;
-	ev.data.ptr = ud;
-	if (epoll_ctl(efd, EPOLL_CTL_MOD, sock, &ev) == -1) {
-		return -1;
-	}
+static int sp_enable_write(int, int, void *) {
 	return 0;
 }
 
-static int sp_disable_write(int efd, int sock, void *ud) {
-	struct epoll_event ev;
-	ev.events = EPOLLIN;
-	ev.data.ptr = ud;
-	if (epoll_ctl(efd, EPOLL_CTL_MOD, sock, &ev) == -1) {
-		return -1;
-	}
+static int sp_disable_write(int, int, void *) {
 	return 0;
 }
 
 static int 
 sp_wait(int efd, struct event *e, int max,  const timespec *timeout) {
-	struct epoll_event ev[max];
-	int n = epoll_wait(efd , ev, max, -1);
+	struct epoll_event ev[SP_MAX_EVENTS];
+	if (max > SP_MAX_EVENTS) {
+		max = SP_MAX_EVENTS;
+	}
+	int ms = -1;
+	if (timeout != nullptr) {
+		ms = timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000;
+	}
+	int n = epoll_wait(efd , ev, max, ms);
 	int i;
 	for (i=0;i<n;i++) {
 		e[i].ud = ev[i].data.ptr;
@@ -101,11 +121,16 @@ sp_wait(int efd, struct event *e, int max,  const timespec *timeout) {
 
 #elif defined(__APPLE__)
 #include <sys/event.h>
+#include <unistd.h>
 
 inline int sp_create(size_t) {
     return kqueue();
 }
 
+static void sp_release(int kfd) {
+	close(kfd);
+}
+
 static void sp_del(int kfd, int sock) {
 	struct kevent ke;
 	EV_SET(&ke, sock, EVFILT_READ, EV_DELETE, 0, 0, NULL);
@@ -173,7 +198,10 @@ sp_add(int kfd, int sock, void *ud) {
 
 static int 
 sp_wait(int kfd, struct event *e, int max, const timespec *timeout) {
-	struct kevent ev[max];
+	struct kevent ev[SP_MAX_EVENTS];
+	if (max > SP_MAX_EVENTS) {
+		max = SP_MAX_EVENTS;
+	}
 	int n = kevent(kfd, NULL, 0, ev, max, timeout);
 
 	int i;
@@ -195,85 +223,385 @@ enum ConnectionStatus {
 	INIT,
 	CONNECTING,
 	CONNECTED,
-	VERSION_SENT
+	VERSION_SENT,
+	ESTABLISHED
+};
+
+// event loop timer resolution and per-connection deadlines
+static const uint32_t TIMER_TICK_MS = 100;
+// longest sleep of a shard with connections, so addresses queued by other
+// threads are still picked up
+static const int ENGINE_MAX_WAIT_MS = 1000;
+static const uint64_t CONNECT_TIMEOUT_MS = 10 * 1000;
+static const uint64_t HANDSHAKE_TIMEOUT_MS = 30 * 1000;
+static const uint64_t IDLE_TIMEOUT_MS = 180 * 1000;
+// crawl mode: how long a getaddr response may stay silent before we give up
+static const uint64_t GETADDR_QUIET_MS = 15 * 1000;
+
+struct NetworkOptions {
+	NetworkOptions(): crawl(false), rstClose(false) {}
+	// ask every peer for its addresses and disconnect once it answered
+	bool crawl;
+	// local addresses outgoing connects are spread over, round robin
+	std::vector<CService> sourceAddrs;
+	// close with RST instead of FIN so that no TIME_WAIT is left behind
+	bool rstClose;
+};
+
+/*
+ * Eviction scoring, all in ms added to the time of last activity so that
+ * scores of different connections stay comparable without rescoring: an
+ * established peer keeps its slot over a handshake in progress, which
+ * keeps it over a socket still connecting, and every new address a peer
+ * gave us buys it more time. The status tiers lie further apart than any
+ * two scores within a tier, so no amount of idle time ranks a peer below
+ * a connect in progress.
+ */
+static const int64_t EVICT_STATUS_TIER = static_cast<int64_t>(1) << 48;
+static const int64_t EVICT_NEW_ADDR_MS = 100;
+static const int64_t EVICT_NEW_ADDR_CAP_MS = 120 * 1000;
+// bonus for a peer whose addresses were all new to us
+static const int64_t EVICT_NOVELTY_MS = 60 * 1000;
+// connected time is charged at this fraction against the score
+static const int64_t EVICT_AGE_DIVISOR = 4;
+
+// iovecs handed to one writev call
+static const int SEND_IOV_MAX = 64;
+
+/*
+ * FIFO of pooled outgoing messages linked through MessageBuffer::next.
+ * Messages are queued with their checksum still blank and only become
+ * sendable once seal() handed them out to be checksummed, so that the
+ * checksums of everything queued in one pass of the event loop can be
+ * computed together. Everything sealed is flushed with a single writev,
+ * and buffers go back to the pool as soon as they are fully written.
+ */
+class SendQueue
+{
+public:
+	SendQueue(): head(nullptr), tail(nullptr), unsealed(nullptr), headPos(0) {}
+	void push(MessageBuffer *msg);
+	// collect the messages queued since the last seal, they are sendable
+	// once the caller has filled in their checksums
+	void seal(std::vector<MessageBuffer *> &msgs);
+	// write as much as the socket accepts, false on a fatal socket error
+	bool flush(int sock, MessagePool &pool);
+	// drop everything still queued
+	void clear(MessagePool &pool);
+	bool empty() const {
+		return head == nullptr;
+	}
+	bool sendable() const {
+		return head != nullptr && head != unsealed;
+	}
+private:
+	void pop(MessagePool &pool);
+	MessageBuffer *head;
+	MessageBuffer *tail;
+	MessageBuffer *unsealed;	// first message without a checksum
+	size_t headPos;		// bytes of the front message already written
+};
+
+// receive ring sizing
+static const size_t RECV_RING_MIN = 8 * 1024;
+
+/*
+ * Per-connection receive ring. read() lands directly in its free space
+ * and the parser works on the bytes in place; only a payload that wraps
+ * around the end of the ring is copied out. The ring grows to fit the
+ * message being received, up to the cap of its command, and drops
+ * back to RECV_RING_MIN once it runs empty.
+ */
+class RecvRing
+{
+public:
+	RecvRing(): head(0), used(0) {}
+	// readv from sock into the free space, returns like read(); drained is
+	// set when the socket had less data than there was room for
+	ssize_t fill(int sock, bool &drained);
+	size_t size() const {
+		return used;
+	}
+	// copy n bytes starting at offset out of the ring
+	void peek(size_t offset, unsigned char *out, size_t n) const;
+	// n bytes at offset in place, or copied into scratch when they wrap
+	const unsigned char *view(size_t offset, size_t n, std::vector<unsigned char> &scratch) const;
+	void consume(size_t n);
+	// make room for a message of n bytes
+	void reserve(size_t n);
+	// whether n bytes at offset can be viewed without a copy
+	bool contiguous(size_t offset, size_t n) const {
+		return ((head + offset) & (buffer.size() - 1)) + n <= buffer.size();
+	}
+private:
+	void resize(size_t capacity);
+	std::vector<unsigned char> buffer;
+	size_t head;
+	size_t used;
+};
+
+class Connection;
+
+/*
+ * A complete inbound message whose checksum is still to be verified, or
+ * an addr message that was decoded and verified while it arrived, whose
+ * addresses wait in conn's readyAddrs.
+ */
+struct InboundFrame {
+	Connection *conn;
+	CMessageHeader header;
+	MessageCommand command;
+	bool streamed;
+	size_t offset;		// of the payload in conn's receive ring, or of the
+				// first address in readyAddrs when streamed
+	size_t nAddrs;		// usable addresses of a streamed addr
+	uint64_t nRecords;	// records it announced
+};
+
+// an addr or addrv2 payload being decoded record by record as it arrives
+struct AddrStream {
+	AddrStream(): active(false), remaining(0), counted(false), count(0), decoded(0) {}
+	bool active;
+	CSHA256 hasher;
+	uint32_t remaining;	// payload bytes still to come
+	bool counted;		// the record count has been read
+	uint64_t count;
+	uint64_t decoded;
+	size_t first;		// of its addresses in readyAddrs
 };
 
 class Connection
 {
 public:
-	Connection(): sock(-1) {
+	Connection(): sock(-1), pool(nullptr) {
 		init();
 	}
-	Connection(int _sock, const CService &addr): sock(_sock), addrYou(addr) {
+	Connection(int _sock, const CService &addr, MessagePool *_pool): sock(_sock), addrYou(addr), pool(_pool) {
         init();
 	}
 	Connection(const Connection &con) = default;
 
 	bool initializeAddress();
-	bool pushVersionCommand(uint32_t);
+	bool pushVersionCommand(const VersionTemplate &versionTemplate);
 	bool pushVerackCommand();
 	bool pushPongCommand(uint64_t nonce);
-	bool pushCommand();
+	bool pushGetaddrCommand();
+	bool pushSendaddrv2Command();
+	bool pushCommand(MessageBuffer *msg);
 	bool sendBuffer(bool &);
-	void processMessage(uint32_t, struct CMessageHeader &header, const std::vector<unsigned char> &buffer, size_t offset);
-	bool readBuffer(uint32_t version);
+	void processMessage(MessageCommand command, const MessageSpan &payload);
+	void processAddr(const CService *addrs, size_t nAddrs, uint64_t nRecords);
+	// read and frame complete messages into frames, they are processed and
+	// consumed once the batch they belong to has been verified
+	bool readBuffer(std::vector<InboundFrame> &frames);
+	bool parseBuffer(std::vector<InboundFrame> &frames);
+	bool streamAddr(std::vector<InboundFrame> &frames);
+	// done with n bytes past the framed ones
+	void release(size_t n);
     void init() {
         status = INIT;
         youVersion = 0;
+		myVersion = 0;
 		youServices = 0;
 		headerValid = false;
-		sendPos = 0;
+		command = CMD_UNKNOWN;
+		framedBytes = 0;
+		readPending = false;
+		skipBytes = 0;
+		framedVersion = 0;
+		addrStream = AddrStream();
+		readyAddrs.clear();
+		lastActive = 0;
+		getaddrSent = false;
+		lastAddr = 0;
+		nAddrReceived = 0;
+		nNewAddr = 0;
+		retire = false;
+		connectStart = 0;
+		inFlight = false;
     }
 	int sock;
 	enum ConnectionStatus status;
     uint32_t youVersion;
+	uint32_t myVersion;		// the one we sent
     uint64_t youServices;
     CService addrMe;
 	CService addrYou;
 	bool headerValid;
 	CMessageHeader header;
-	int sendPos;
-	std::vector<unsigned char> vReadBuffer;
-	std::vector<unsigned char> vSendBuffer;
-	std::list<std::vector<unsigned char>> sendingBuffer;
+	MessageCommand command;		// of header, decoded once per message
+	RecvRing recvRing;
+	size_t framedBytes;		// at the front of recvRing, framed but not processed
+	bool readPending;		// stopped reading on a ring full of framed messages
+	uint32_t skipBytes;		// left of a payload dropped as it arrives
+	// addr records are decoded before the version ahead of them is
+	// processed, their layout follows the version last framed
+	uint32_t framedVersion;
+	AddrStream addrStream;
+	std::vector<CService> readyAddrs;	// of streamed addr frames not yet processed
+	MessagePool *pool;
+	SendQueue sendQueue;
+	uint64_t lastActive;
+	TimerNode timer;
+	// crawl mode bookkeeping of the getaddr exchange
+	bool getaddrSent;
+	uint64_t lastAddr;
+	uint32_t nAddrReceived;
+	bool retire;		// got what we came for, close
+	// eviction ranking
+	uint32_t nNewAddr;
+	uint64_t connectStart;
+	// counted in nConnecting, cleared once by whichever of completion or
+	// close comes first
+	bool inFlight;
+	EvictionNode evictNode;
 };
 
-typedef std::function<bool (const struct event &event, int &sock, bool &moreWrite)> NetworkCallback;
+// all per-connection state of one fd, event.ud points here
+struct ConnectionSlot {
+	ConnectionSlot(): inUse(false), writeEnabled(false), dirty(false), closing(false), prevStatus(INIT) {}
+	Connection conn;
+	bool inUse;
+	bool writeEnabled;
+	// per event loop pass: had an event, has to be closed, status before
+	bool dirty;
+	bool closing;
+	ConnectionStatus prevStatus;
+};
 
+/*
+ * Dense table of connection slots indexed by fd. Slots are allocated in
+ * fixed-size chunks on first use and never move, so their address can be
+ * registered with the poller. fds are unique in the process, so all
+ * shards share one slab and each only touches the slots of its own fds.
+ */
+class ConnectionSlab
+{
+public:
+	ConnectionSlab();
+	~ConnectionSlab();
+	ConnectionSlab(const ConnectionSlab &) = delete;
+	ConnectionSlab &operator=(const ConnectionSlab &) = delete;
+	ConnectionSlot *slot(int sock) {
+		size_t index = static_cast<size_t>(sock) >> SLAB_CHUNK_BITS;
+		if (sock < 0 || index >= nChunks) {
+			return nullptr;
+		}
+		ConnectionSlot *chunk = chunks[index].load(std::memory_order_acquire);
+		if (chunk == nullptr) {
+			chunk = allocChunk(index);
+		}
+		return &chunk[sock & (SLAB_CHUNK_SIZE - 1)];
+	}
+private:
+	static const int SLAB_CHUNK_BITS = 10;
+	static const int SLAB_CHUNK_SIZE = 1 << SLAB_CHUNK_BITS;
+	ConnectionSlot *allocChunk(size_t index);
+	size_t nChunks;
+	std::unique_ptr<std::atomic<ConnectionSlot *>[]> chunks;
+	std::mutex chunkLock;
+};
 
 class ConnectionManager
 {
 public:
-	ConnectionManager(uint32_t version): mVersion(version) {}
-	NetworkCallback *initiateConnection(const CService &addr, int &sock);
-	bool networkCallback(int sock, const struct event &event, int &rsock, bool &moreWrite);
-	int evictSock();
-	NetworkCallback *getNetworkCallback(int sock) {
-		return &callbacks[sock];
+	ConnectionManager(uint32_t version, ConnectionSlab &_slab, const NetworkOptions &options):
+		mVersion(version), versionTemplate(version), slab(_slab), mOptions(options), nConnections(0), nConnecting(0), nextSource(0), mNow(monotonicMs()),
+		timers(TIMER_TICK_MS, mNow), connects(mNow) {}
+	ConnectionSlot *initiateConnection(const CService &addr, int &sock);
+	/*
+	 * One pass of the event loop: handleEvent for every event, returning
+	 * false when the connection has to be closed, then finishEvents to
+	 * verify and process what was read and checksum what was queued, all
+	 * in batches, then flushEvent for each slot in dirtySlots().
+	 */
+	bool handleEvent(ConnectionSlot &slot, const struct event &event);
+	void finishEvents();
+	const std::vector<ConnectionSlot *> &dirtySlots() const {
+		return vDirty;
 	}
+	// returns false when the connection has to be closed
+	bool flushEvent(ConnectionSlot &slot, bool &moreWrite);
+	void clearDirty();
+	// lowest-value connection, the caller is expected to close it
+	int evictSock();
 	void closeConnection(int sock);
 	size_t connectionCount() {
-		return connections.size();
+		return nConnections;
+	}
+	// close-worthy sockets whose connect, handshake or idle deadline passed
+	void expireTimers(uint64_t now, std::vector<int> &timedOut);
+	// refresh the loop clock after anything that may have blocked
+	void setNow(uint64_t now) {
+		mNow = now;
+	}
+	int nextTimeoutMs() const {
+		int timeoutMs = timers.nextTimeoutMs(mNow);
+		if (timeoutMs < 0 || timeoutMs > ENGINE_MAX_WAIT_MS) {
+			return nConnections > 0 ? ENGINE_MAX_WAIT_MS : timeoutMs;
+		}
+		return timeoutMs;
+	}
+	// how many new connects the connect controller lets us start now
+	size_t connectAllowance() {
+		return connects.allowance(mNow, nConnecting);
+	}
+	// ms until connectAllowance can grow again, -1 if it is not rate-bound
+	int connectWaitMs() const {
+		return connects.waitMs();
+	}
+	void connectLimited() {
+		connects.onLimited();
 	}
 private:
+	void connectFailed(const Connection &conn, int err);
+	// the connect of conn completed or was abandoned
+	void connectSettled(Connection &conn);
+	void processInbound();
+	void sealOutbound();
+	void afterEvents(ConnectionSlot &slot);
+	bool bindSource(int sock, const CService &addr);
+	void armTimer(Connection &conn);
+	int64_t evictionScore(const Connection &conn) const;
 	uint32_t mVersion;
-	Connection *addConnection(const CService &addr, int sock);
-	std::map<int, Connection> connections;
-	std::map<int, NetworkCallback> callbacks;
-	std::deque<int> qSocks;
+	VersionTemplate versionTemplate;
+	ConnectionSlab &slab;
+	NetworkOptions mOptions;
+	size_t nConnections;
+	size_t nConnecting;
+	size_t nextSource;
+	uint64_t mNow;
+	TimerWheel timers;
+	ConnectController connects;
+	std::vector<TimerNode *> vExpired;
+	MessagePool messagePool;
+	// batch state of the current event loop pass
+	std::vector<ConnectionSlot *> vDirty;
+	std::vector<InboundFrame> vInbound;
+	std::vector<MessageBuffer *> vOutbound;
+	std::vector<const unsigned char *> vHashData;
+	std::vector<size_t> vHashLen;
+	std::vector<unsigned char> vHashes;	// SHA256_OUTPUT_SIZE bytes each
+	std::vector<unsigned char> vWrapped;
+	ConnectionSlot *addConnection(const CService &addr, int sock);
+	EvictionHeap evictions;
 };
 
 class NetworkEngine
 {
 public:
-	NetworkEngine(uint32_t version): connMan(version), nPendingEvents(0), sp(-1) {}
+	NetworkEngine(uint32_t version, ConnectionSlab &slab, const NetworkOptions &options, int _shardId = 0, int _shardCount = 1):
+		sp(-1), connMan(version, slab, options), shardId(_shardId), shardCount(_shardCount) {}
+	NetworkEngine(const NetworkEngine &) = delete;
+	NetworkEngine &operator=(const NetworkEngine &) = delete;
+	~NetworkEngine();
     bool initEngine();
 	void startEngine();
 	void remove_socket(int sock) {
 		sp_del(sp, sock);
 	}
-	int add_socket(int sock, NetworkCallback *cb) {
-		return sp_add(sp, sock, (void *)cb);
+	int add_socket(int sock, ConnectionSlot *slot) {
+		return sp_add(sp, sock, (void *)slot);
 	}
 private:
 	void dispatchNetworkEvents(int nActiveEvents);
@@ -281,7 +609,29 @@ private:
 	ConnectionManager connMan;
 	int maxConnections;
 	std::vector<event> events;
-	std::map<int, bool> writeEnabled;
-	int nPendingEvents;
+	std::vector<int> timedOut;
+	std::vector<int> closeSocks;
+	int shardId;
+	int shardCount;
+};
+
+/*
+ * Runs one NetworkEngine per shard, each on its own thread with its own
+ * sp fd, ConnectionManager and event array. Shards share nothing but
+ * CAddrSeed, from which each one drains new addresses independently, so
+ * addresses are spread over the shards by how fast each one consumes them.
+ */
+class ShardedNetworkEngine
+{
+public:
+	ShardedNetworkEngine(uint32_t version, int shardCount, const NetworkOptions &options);
+	bool initEngine();
+	void startEngine();
+	size_t shardCount() const {
+		return engines.size();
+	}
+private:
+	ConnectionSlab slab;
+	std::vector<std::unique_ptr<NetworkEngine>> engines;
 };
 #endif
\ No newline at end of file
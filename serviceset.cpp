@@ -0,0 +1,134 @@
+#include "serviceset.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+const size_t INITIAL_GROUPS = 64;
+
+inline size_t groupOf(uint64_t hash)
+{
+    return static_cast<size_t>(hash >> 7);
+}
+
+inline int8_t tagOf(uint64_t hash)
+{
+    return static_cast<int8_t>(hash & 0x7f);
+}
+
+// bit i set when control byte i of the group equals tag
+inline uint32_t matchTag(const int8_t *group, int8_t tag)
+{
+#if defined(__SSE2__)
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(tag))));
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < ServiceSet::GROUP_SIZE; ++i) {
+        bits |= static_cast<uint32_t>(group[i] == tag) << i;
+    }
+    return bits;
+#endif
+}
+
+// empty is the only control byte with the sign bit set
+inline uint32_t matchEmpty(const int8_t *group)
+{
+#if defined(__SSE2__)
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+    return static_cast<uint32_t>(_mm_movemask_epi8(bytes));
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < ServiceSet::GROUP_SIZE; ++i) {
+        bits |= static_cast<uint32_t>(group[i] < 0) << i;
+    }
+    return bits;
+#endif
+}
+
+}
+
+const int8_t ServiceSet::CTRL_EMPTY;
+
+ServiceSet::ServiceSet():
+    mask(INITIAL_GROUPS - 1),
+    count(0),
+    growthLeft(INITIAL_GROUPS * GROUP_SIZE * 7 / 8),
+    ctrl(INITIAL_GROUPS * GROUP_SIZE, CTRL_EMPTY),
+    slots(INITIAL_GROUPS * GROUP_SIZE)
+{
+}
+
+bool ServiceSet::find(const CService &addr, uint64_t hash) const
+{
+    int8_t tag = tagOf(hash);
+    size_t group = groupOf(hash) & mask;
+    // triangular probing visits every group once the count is a power of two
+    for (size_t step = 1; ; ++step) {
+        const int8_t *ctrlGroup = &ctrl[group * GROUP_SIZE];
+        for (uint32_t bits = matchTag(ctrlGroup, tag); bits != 0; bits &= bits - 1) {
+            if (slots[group * GROUP_SIZE + __builtin_ctz(bits)] == addr) {
+                return true;
+            }
+        }
+        if (matchEmpty(ctrlGroup) != 0) {
+            return false;
+        }
+        group = (group + step) & mask;
+    }
+}
+
+size_t ServiceSet::findEmpty(uint64_t hash) const
+{
+    size_t group = groupOf(hash) & mask;
+    for (size_t step = 1; ; ++step) {
+        uint32_t bits = matchEmpty(&ctrl[group * GROUP_SIZE]);
+        if (bits != 0) {
+            return group * GROUP_SIZE + __builtin_ctz(bits);
+        }
+        group = (group + step) & mask;
+    }
+}
+
+bool ServiceSet::contains(const CService &addr) const
+{
+    return find(addr, addr.GetHash());
+}
+
+bool ServiceSet::insert(const CService &addr)
+{
+    uint64_t hash = addr.GetHash();
+    if (find(addr, hash)) {
+        return false;
+    }
+    if (growthLeft == 0) {
+        grow();
+    }
+    size_t slot = findEmpty(hash);
+    ctrl[slot] = tagOf(hash);
+    slots[slot] = addr;
+    count++;
+    growthLeft--;
+    return true;
+}
+
+void ServiceSet::grow()
+{
+    std::vector<int8_t> oldCtrl(2 * ctrl.size(), CTRL_EMPTY);
+    std::vector<CService> oldSlots(2 * slots.size());
+    oldCtrl.swap(ctrl);
+    oldSlots.swap(slots);
+    mask = 2 * (mask + 1) - 1;
+    growthLeft = ctrl.size() * 7 / 8 - count;
+    for (size_t i = 0; i < oldCtrl.size(); ++i) {
+        if (oldCtrl[i] == CTRL_EMPTY) {
+            continue;
+        }
+        uint64_t hash = oldSlots[i].GetHash();
+        size_t slot = findEmpty(hash);
+        ctrl[slot] = tagOf(hash);
+        slots[slot] = oldSlots[i];
+    }
+}
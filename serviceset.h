@@ -0,0 +1,48 @@
+#ifndef __SERVICESET_H__
+#define __SERVICESET_H__
+
+#include <bitcoin/protocol.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/*
+ * Open-addressing hash set of CService, keyed by address and port. Slots
+ * come in groups of GROUP_SIZE, each with one control byte: CTRL_EMPTY,
+ * or the low 7 bits of the hash when full. A lookup compares a whole
+ * group of control bytes at once and only touches the slots whose byte
+ * matches, so most misses never read an address. Nothing is ever erased.
+ */
+class ServiceSet
+{
+public:
+    static const size_t GROUP_SIZE = 16;
+
+    ServiceSet();
+    ServiceSet(const ServiceSet &) = delete;
+    ServiceSet &operator=(const ServiceSet &) = delete;
+
+    // false when addr was already in the set
+    bool insert(const CService &addr);
+    bool contains(const CService &addr) const;
+    size_t size() const {
+        return count;
+    }
+
+private:
+    static const int8_t CTRL_EMPTY = -128;
+
+    bool find(const CService &addr, uint64_t hash) const;
+    // first empty slot along the probe sequence of hash
+    size_t findEmpty(uint64_t hash) const;
+    void grow();
+
+    size_t mask;    // number of groups - 1
+    size_t count;
+    size_t growthLeft;
+    std::vector<int8_t> ctrl;
+    std::vector<CService> slots;
+};
+
+#endif
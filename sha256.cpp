@@ -0,0 +1,517 @@
+#include "sha256.h"
+
+#include <bitcoin/endian.h>
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_X86_SHA256 1
+#endif
+
+typedef void (*TransformFunc)(uint32_t *s, const unsigned char *chunk, size_t blocks);
+
+alignas(16) static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t INIT[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static inline uint32_t readBE32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return be32toh(v);
+}
+
+static inline void writeBE32(unsigned char *p, uint32_t v)
+{
+    v = htobe32(v);
+    memcpy(p, &v, 4);
+}
+
+static inline uint32_t ror(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static void transformGeneric(uint32_t *s, const unsigned char *chunk, size_t blocks)
+{
+    while (blocks--) {
+        uint32_t w[64];
+        for (auto i = 0; i < 16; ++i) {
+            w[i] = readBE32(chunk + 4 * i);
+        }
+        for (auto i = 16; i < 64; ++i) {
+            uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (auto i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        s[0] += a;
+        s[1] += b;
+        s[2] += c;
+        s[3] += d;
+        s[4] += e;
+        s[5] += f;
+        s[6] += g;
+        s[7] += h;
+        chunk += 64;
+    }
+}
+
+#if HAVE_X86_SHA256
+/*
+ * SHA-NI: sha256rnds2 runs two rounds on the state kept as ABEF/CDGH
+ * halves, sha256msg1/msg2 extend the message schedule four words at a
+ * time.
+ */
+#define SHANI_TARGET __attribute__((target("sha,sse4.1")))
+
+SHANI_TARGET static inline void quadRound(__m128i &state0, __m128i &state1, __m128i m, int i)
+{
+    __m128i msg = _mm_add_epi32(m, _mm_load_si128(reinterpret_cast<const __m128i *>(&K[i * 4])));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+}
+
+// m0 = next four schedule words, from m0..m3 of the previous quad
+SHANI_TARGET static inline void scheduleNext(__m128i &m0, __m128i m1, __m128i m2, __m128i m3)
+{
+    m0 = _mm_sha256msg1_epu32(m0, m1);
+    m0 = _mm_add_epi32(m0, _mm_alignr_epi8(m3, m2, 4));
+    m0 = _mm_sha256msg2_epu32(m0, m3);
+}
+
+SHANI_TARGET static void transformShaNI(uint32_t *s, const unsigned char *chunk, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+    __m128i state1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 4));
+    // DCBA, HGFE -> ABEF, CDGH
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);
+    state1 = _mm_shuffle_epi32(state1, 0x1b);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    while (blocks--) {
+        __m128i save0 = state0;
+        __m128i save1 = state1;
+        __m128i m[4];
+#pragma GCC unroll 4
+        for (auto i = 0; i < 4; ++i) {
+            m[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(chunk + 16 * i)), mask);
+            quadRound(state0, state1, m[i], i);
+        }
+#pragma GCC unroll 12
+        for (auto i = 4; i < 16; ++i) {
+            scheduleNext(m[i & 3], m[(i + 1) & 3], m[(i + 2) & 3], m[(i + 3) & 3]);
+            quadRound(state0, state1, m[i & 3], i);
+        }
+        state0 = _mm_add_epi32(state0, save0);
+        state1 = _mm_add_epi32(state1, save1);
+        chunk += 64;
+    }
+
+    // ABEF, CDGH -> DCBA, HGFE
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(s), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(s + 4), state1);
+}
+
+static bool haveShaNI()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) {
+        return false;
+    }
+    if (__get_cpuid_max(0, nullptr) < 7) {
+        return false;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 29)) != 0;
+}
+#endif
+
+/*
+ * Multi-buffer SHA-256 with GCC vector extensions: every 32-bit lane of V
+ * carries the state of a different message. The code is written once and
+ * compiled for each vector width in a function with the matching target.
+ */
+#define SHA256_ALWAYS_INLINE inline __attribute__((always_inline))
+
+typedef void (*DoubleManyFunc)(const unsigned char *const data[], const size_t len[], unsigned char (*hash)[SHA256_OUTPUT_SIZE], size_t n);
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+#if HAVE_X86_SHA256
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+typedef uint32_t v16u32 __attribute__((vector_size(64)));
+#endif
+
+// a macro rather than a function, so no vector crosses a call boundary
+#define VROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// one block of every lane, block[j] is the 64 bytes for lane j
+template <typename V>
+SHA256_ALWAYS_INLINE void transformLanes(V s[8], const unsigned char *const block[])
+{
+    const int lanes = sizeof(V) / sizeof(uint32_t);
+    V w[16];
+    for (auto i = 0; i < 16; ++i) {
+        for (auto j = 0; j < lanes; ++j) {
+            w[i][j] = readBE32(block[j] + 4 * i);
+        }
+    }
+    V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (auto i = 0; i < 64; ++i) {
+        if (i >= 16) {
+            V x = w[(i - 15) & 15];
+            V y = w[(i - 2) & 15];
+            w[i & 15] += (VROR(x, 7) ^ VROR(x, 18) ^ (x >> 3)) + w[(i - 7) & 15] + (VROR(y, 17) ^ VROR(y, 19) ^ (y >> 10));
+        }
+        V t1 = h + (VROR(e, 6) ^ VROR(e, 11) ^ VROR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i & 15];
+        V t2 = (VROR(a, 2) ^ VROR(a, 13) ^ VROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    s[0] += a;
+    s[1] += b;
+    s[2] += c;
+    s[3] += d;
+    s[4] += e;
+    s[5] += f;
+    s[6] += g;
+    s[7] += h;
+}
+
+/*
+ * Messages of different lengths share the lanes: a lane whose message is
+ * done is refilled with the next one, idle lanes hash a dummy block. The
+ * second pass hashes 32 bytes for every message, so it runs in lockstep.
+ */
+template <typename V>
+SHA256_ALWAYS_INLINE void dsha256Lanes(const unsigned char *const data[], const size_t len[], unsigned char (*hash)[SHA256_OUTPUT_SIZE], size_t n)
+{
+    const int lanes = sizeof(V) / sizeof(uint32_t);
+    static const size_t IDLE = static_cast<size_t>(-1);
+    static const unsigned char dummy[64] = {0};
+    struct Lane {
+        size_t job;
+        size_t block;
+        size_t fullBlocks;
+        size_t nBlocks;
+        unsigned char tail[128];    // last partial block plus padding
+    } lane[lanes];
+    const unsigned char *block[lanes];
+    V s[8];
+
+    size_t next = 0;
+    int active = 0;
+    for (auto j = 0; j < lanes; ++j) {
+        lane[j].job = IDLE;
+    }
+    while (true) {
+        for (auto j = 0; j < lanes; ++j) {
+            Lane &l = lane[j];
+            if (l.job == IDLE && next < n) {
+                size_t size = len[next];
+                size_t rem = size % 64;
+                l.job = next++;
+                l.block = 0;
+                l.fullBlocks = size / 64;
+                size_t tailBlocks = rem + 9 <= 64 ? 1 : 2;
+                l.nBlocks = l.fullBlocks + tailBlocks;
+                memset(l.tail, 0, tailBlocks * 64);
+                memcpy(l.tail, data[l.job] + l.fullBlocks * 64, rem);
+                l.tail[rem] = 0x80;
+                uint64_t bits = htobe64(static_cast<uint64_t>(size) << 3);
+                memcpy(l.tail + tailBlocks * 64 - 8, &bits, 8);
+                for (auto k = 0; k < 8; ++k) {
+                    s[k][j] = INIT[k];
+                }
+                active++;
+            }
+            if (l.job == IDLE) {
+                block[j] = dummy;
+            } else if (l.block < l.fullBlocks) {
+                block[j] = data[l.job] + l.block * 64;
+            } else {
+                block[j] = l.tail + (l.block - l.fullBlocks) * 64;
+            }
+        }
+        if (active == 0) {
+            break;
+        }
+        transformLanes(s, block);
+        for (auto j = 0; j < lanes; ++j) {
+            Lane &l = lane[j];
+            if (l.job == IDLE || ++l.block < l.nBlocks) {
+                continue;
+            }
+            for (auto k = 0; k < 8; ++k) {
+                writeBE32(hash[l.job] + 4 * k, s[k][j]);
+            }
+            l.job = IDLE;
+            active--;
+        }
+    }
+
+    unsigned char second[lanes][64];
+    for (auto j = 0; j < lanes; ++j) {
+        memset(second[j] + 32, 0, 32);
+        second[j][32] = 0x80;
+        second[j][62] = 0x01;
+        block[j] = second[j];
+    }
+    for (size_t base = 0; base < n; base += lanes) {
+        int count = n - base < static_cast<size_t>(lanes) ? n - base : lanes;
+        for (auto j = 0; j < count; ++j) {
+            memcpy(second[j], hash[base + j], 32);
+        }
+        for (auto k = 0; k < 8; ++k) {
+            for (auto j = 0; j < lanes; ++j) {
+                s[k][j] = INIT[k];
+            }
+        }
+        transformLanes(s, block);
+        for (auto j = 0; j < count; ++j) {
+            for (auto k = 0; k < 8; ++k) {
+                writeBE32(hash[base + j] + 4 * k, s[k][j]);
+            }
+        }
+    }
+}
+
+static void dsha256Single(const unsigned char *const data[], const size_t len[], unsigned char (*hash)[SHA256_OUTPUT_SIZE], size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        dsha256(data[i], len[i], hash[i]);
+    }
+}
+
+static void dsha256x4(const unsigned char *const data[], const size_t len[], unsigned char (*hash)[SHA256_OUTPUT_SIZE], size_t n)
+{
+    dsha256Lanes<v4u32>(data, len, hash, n);
+}
+
+#if HAVE_X86_SHA256
+__attribute__((target("avx2")))
+static void dsha256x8(const unsigned char *const data[], const size_t len[], unsigned char (*hash)[SHA256_OUTPUT_SIZE], size_t n)
+{
+    dsha256Lanes<v8u32>(data, len, hash, n);
+}
+
+__attribute__((target("avx512f")))
+static void dsha256x16(const unsigned char *const data[], const size_t len[], unsigned char (*hash)[SHA256_OUTPUT_SIZE], size_t n)
+{
+    dsha256Lanes<v16u32>(data, len, hash, n);
+}
+
+// __builtin_cpu_supports also checks that the OS saves the wide registers
+static bool haveAVX2()
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool haveAVX512()
+{
+    return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+struct Sha256Dispatch {
+    Sha256Dispatch(): transform(transformGeneric), name("generic") {
+#if HAVE_X86_SHA256
+        if (haveShaNI()) {
+            transform = transformShaNI;
+            name = "sha-ni";
+        }
+#endif
+    }
+    TransformFunc transform;
+    const char *name;
+};
+
+static const Sha256Dispatch &dispatch()
+{
+    static const Sha256Dispatch d;
+    return d;
+}
+
+/*
+ * Whether wide lanes or the SHA instructions hash a batch faster depends
+ * on the microarchitecture, so the candidates are timed once on a batch
+ * of small messages and the fastest one is kept.
+ */
+struct Sha256ManyDispatch {
+    Sha256ManyDispatch(): many(dsha256x4), name("4-way") {
+        std::vector<std::pair<DoubleManyFunc, const char *>> candidates;
+        candidates.push_back(std::make_pair(dsha256x4, "4-way"));
+#if HAVE_X86_SHA256
+        if (haveAVX2()) {
+            candidates.push_back(std::make_pair(dsha256x8, "8-way avx2"));
+        }
+        if (haveAVX512()) {
+            candidates.push_back(std::make_pair(dsha256x16, "16-way avx512"));
+        }
+        if (haveShaNI()) {
+            candidates.push_back(std::make_pair(dsha256Single, "sha-ni"));
+        }
+#endif
+        if (candidates.size() == 1) {
+            return;
+        }
+        const size_t n = 64;
+        unsigned char payload[n][8];
+        const unsigned char *data[n];
+        size_t len[n];
+        unsigned char hash[n][SHA256_OUTPUT_SIZE];
+        for (size_t i = 0; i < n; ++i) {
+            memset(payload[i], static_cast<int>(i), sizeof(payload[i]));
+            data[i] = payload[i];
+            len[i] = sizeof(payload[i]);
+        }
+        auto best = std::chrono::steady_clock::duration::max();
+        for (auto &candidate: candidates) {
+            auto elapsed = std::chrono::steady_clock::duration::max();
+            for (auto round = 0; round < 3; ++round) {
+                auto start = std::chrono::steady_clock::now();
+                candidate.first(data, len, hash, n);
+                elapsed = std::min(elapsed, std::chrono::steady_clock::now() - start);
+            }
+            if (elapsed < best) {
+                best = elapsed;
+                many = candidate.first;
+                name = candidate.second;
+            }
+        }
+    }
+    DoubleManyFunc many;
+    const char *name;
+};
+
+static const Sha256ManyDispatch &manyDispatch()
+{
+    static const Sha256ManyDispatch d;
+    return d;
+}
+
+const char *sha256Implementation()
+{
+    return dispatch().name;
+}
+
+const char *sha256ManyImplementation()
+{
+    return manyDispatch().name;
+}
+
+void dsha256Many(const unsigned char *const data[], const size_t len[], unsigned char (*hash)[SHA256_OUTPUT_SIZE], size_t n)
+{
+    if (n == 1) {
+        dsha256(data[0], len[0], hash[0]);
+        return;
+    }
+    manyDispatch().many(data, len, hash, n);
+}
+
+CSHA256::CSHA256()
+{
+    Reset();
+}
+
+CSHA256 &CSHA256::Reset()
+{
+    memcpy(s, INIT, sizeof(s));
+    bytes = 0;
+    return *this;
+}
+
+CSHA256 &CSHA256::Write(const unsigned char *data, size_t len)
+{
+    TransformFunc transform = dispatch().transform;
+    size_t used = bytes % 64;
+    bytes += len;
+    if (used != 0) {
+        size_t fill = 64 - used;
+        if (len < fill) {
+            memcpy(buf + used, data, len);
+            return *this;
+        }
+        memcpy(buf + used, data, fill);
+        transform(s, buf, 1);
+        data += fill;
+        len -= fill;
+    }
+    if (len >= 64) {
+        transform(s, data, len / 64);
+        data += len & ~static_cast<size_t>(63);
+        len &= 63;
+    }
+    memcpy(buf, data, len);
+    return *this;
+}
+
+void CSHA256::Finalize(unsigned char hash[SHA256_OUTPUT_SIZE])
+{
+    static const unsigned char pad[64] = {0x80};
+    unsigned char sizedesc[8];
+    uint64_t bits = htobe64(bytes << 3);
+    memcpy(sizedesc, &bits, 8);
+    Write(pad, 1 + ((119 - (bytes % 64)) % 64));
+    Write(sizedesc, 8);
+    for (auto i = 0; i < 8; ++i) {
+        writeBE32(hash + 4 * i, s[i]);
+    }
+}
+
+void dsha256(const unsigned char *data, size_t len, unsigned char hash[SHA256_OUTPUT_SIZE])
+{
+    unsigned char block[64];
+    CSHA256().Write(data, len).Finalize(block);
+    // the second pass is always one block: 32 bytes, padding, length 256
+    memset(block + 32, 0, 32);
+    block[32] = 0x80;
+    block[62] = 0x01;
+    uint32_t s[8];
+    memcpy(s, INIT, sizeof(s));
+    dispatch().transform(s, block, 1);
+    for (auto i = 0; i < 8; ++i) {
+        writeBE32(hash + 4 * i, s[i]);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+static const size_t SHA256_OUTPUT_SIZE = 32;
+
+/*
+ * Incremental SHA-256. The compression function is picked once at
+ * runtime: SHA-NI where the CPU has it, portable code otherwise.
+ */
+class CSHA256
+{
+public:
+    CSHA256();
+    CSHA256 &Write(const unsigned char *data, size_t len);
+    void Finalize(unsigned char hash[SHA256_OUTPUT_SIZE]);
+    CSHA256 &Reset();
+
+private:
+    uint32_t s[8];
+    unsigned char buf[64];
+    uint64_t bytes;
+};
+
+// SHA256(SHA256(data)), as used for message checksums
+void dsha256(const unsigned char *data, size_t len, unsigned char hash[SHA256_OUTPUT_SIZE]);
+
+/*
+ * dsha256 of n independent messages at once. Where the CPU has no SHA
+ * instructions the messages are hashed side by side in SIMD lanes, 4, 8
+ * or 16 at a time, which is what makes hashing many small messages
+ * cheap.
+ */
+void dsha256Many(const unsigned char *const data[], const size_t len[], unsigned char (*hash)[SHA256_OUTPUT_SIZE], size_t n);
+
+// name of the compression function in use, for logging
+const char *sha256Implementation();
+const char *sha256ManyImplementation();
+
+#endif
@@ -0,0 +1,504 @@
+/*
+ * io_uring backend for the sp_* poll abstraction in network.h.
+ *
+ * Registrations do not issue a syscall each like epoll_ctl does. They are
+ * queued as POLL_ADD/POLL_REMOVE submissions and handed to the kernel
+ * together with the wait in a single io_uring_enter() call per loop
+ * iteration, and completions are reaped in bulk straight from the shared
+ * completion ring. Only readiness goes through the ring: recv, send and
+ * connect are still issued directly by the engine.
+ *
+ * Polls are multishot, armed once for both directions, which gives the
+ * same edge-triggered contract as the epoll backend: every completion
+ * reports new readiness and the engine drains until EAGAIN, so there is
+ * nothing to re-arm per event and write enable/disable only record the
+ * interest. A poll is only re-armed when the kernel ends it (no
+ * IORING_CQE_F_MORE). Kernels before 5.13 reject multishot with EINVAL;
+ * the ring then falls back to one-shot polls re-armed on the next sp_wait,
+ * and since an idle socket is always writable those only carry POLLOUT
+ * while the engine has data queued. Every (re)arm carries a per-socket
+ * generation in its user_data so completions for a poll that was removed
+ * or replaced are recognised and dropped.
+ *
+ * Built only with -DUSE_IO_URING on linux.
+ */
+#if defined(__linux__) && defined(USE_IO_URING)
+
+#include "network.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+static const unsigned URING_SQ_ENTRIES = 4096;
+static const unsigned URING_CQ_ENTRIES = 65536;
+static const int URING_MAX_RINGS = 1024;
+
+// user_data layout: bit 63 marks our own bookkeeping requests, bits 32-62
+// carry the generation and bits 0-31 the socket
+static const uint64_t URING_TAG_INTERNAL = 1ULL << 63;
+static const uint32_t URING_GEN_MASK = 0x7fffffff;
+
+struct sp_uring_slot {
+	void *ud;
+	uint32_t mask;		// interest the engine asked for, POLLOUT only while it has data to send
+	uint32_t armedMask;
+	uint32_t gen;
+	bool active;
+	bool armed;
+	bool multi;			// the armed poll is multishot
+	bool queued;
+	bool readOnly;
+};
+
+struct sp_uring {
+	int fd;
+	unsigned features;
+
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned sqMask;
+	unsigned *sqArray;
+	struct io_uring_sqe *sqes;
+	unsigned sqPending;
+
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe *cqes;
+
+	void *sqRing;
+	size_t sqRingSize;
+	void *cqRing;
+	size_t cqRingSize;
+	size_t sqesSize;
+
+	struct __kernel_timespec ts;
+	bool timeoutPending;
+	bool multishot;
+
+	std::vector<sp_uring_slot> slots;
+	std::vector<int> rearm;
+};
+
+static std::mutex uringTableLock;
+static sp_uring *uringTable[URING_MAX_RINGS];
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, const void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argsz);
+}
+
+static sp_uring *uring_get(int efd)
+{
+	if (efd < 0 || efd >= URING_MAX_RINGS) {
+		return nullptr;
+	}
+	return uringTable[efd];
+}
+
+static void uring_unmap(sp_uring *ring)
+{
+	if (ring->sqes != nullptr && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqesSize);
+	}
+	if (ring->cqRing != nullptr && ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing) {
+		munmap(ring->cqRing, ring->cqRingSize);
+	}
+	if (ring->sqRing != nullptr && ring->sqRing != MAP_FAILED) {
+		munmap(ring->sqRing, ring->sqRingSize);
+	}
+}
+
+// hand every queued sqe to the kernel without waiting
+static int uring_flush(sp_uring *ring)
+{
+	while (ring->sqPending > 0) {
+		int n = io_uring_enter(ring->fd, ring->sqPending, 0, 0, nullptr, 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		ring->sqPending -= n;
+	}
+	return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(sp_uring *ring)
+{
+	unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sqTail;
+	if (tail - head >= ring->sqMask + 1) {
+		if (uring_flush(ring) < 0) {
+			return nullptr;
+		}
+		head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+		if (tail - head >= ring->sqMask + 1) {
+			return nullptr;
+		}
+	}
+	unsigned index = tail & ring->sqMask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqArray[index] = index;
+	__atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+	ring->sqPending++;
+	return sqe;
+}
+
+static uint64_t uring_user_data(int sock, uint32_t gen)
+{
+	return (static_cast<uint64_t>(gen & URING_GEN_MASK) << 32) | static_cast<uint32_t>(sock);
+}
+
+static sp_uring_slot &uring_slot(sp_uring *ring, int sock)
+{
+	if (static_cast<size_t>(sock) >= ring->slots.size()) {
+		sp_uring_slot empty;
+		memset(&empty, 0, sizeof(empty));
+		ring->slots.resize(sock + 1, empty);
+	}
+	return ring->slots[sock];
+}
+
+static int uring_poll_remove(sp_uring *ring, int sock, sp_uring_slot &slot)
+{
+	if (!slot.armed) {
+		return 0;
+	}
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	if (sqe == nullptr) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = uring_user_data(sock, slot.gen);
+	sqe->user_data = URING_TAG_INTERNAL;
+	slot.armed = false;
+	return 0;
+}
+
+static void uring_schedule_arm(sp_uring *ring, int sock, sp_uring_slot &slot)
+{
+	if (!slot.queued) {
+		slot.queued = true;
+		ring->rearm.push_back(sock);
+	}
+}
+
+static uint32_t uring_arm_mask(const sp_uring *ring, const sp_uring_slot &slot)
+{
+	if (slot.readOnly) {
+		return POLLIN;
+	}
+	return ring->multishot ? (POLLIN | POLLOUT) : slot.mask;
+}
+
+static int uring_add(int efd, int sock, void *ud, uint32_t mask)
+{
+	sp_uring *ring = uring_get(efd);
+	if (ring == nullptr || sock < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	sp_uring_slot &slot = uring_slot(ring, sock);
+	if (slot.active) {
+		errno = EEXIST;
+		return -1;
+	}
+	slot.active = true;
+	slot.ud = ud;
+	slot.mask = mask;
+	slot.readOnly = (mask & POLLOUT) == 0;
+	slot.gen = (slot.gen + 1) & URING_GEN_MASK;
+	uring_schedule_arm(ring, sock, slot);
+	return 0;
+}
+
+int sp_create(size_t)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ_ENTRIES;
+	int fd = io_uring_setup(URING_SQ_ENTRIES, &p);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fd >= URING_MAX_RINGS) {
+		close(fd);
+		errno = EMFILE;
+		return -1;
+	}
+
+	sp_uring *ring = new sp_uring();
+	ring->fd = fd;
+	ring->features = p.features;
+	ring->multishot = true;
+	ring->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sqRingSize = ring->cqRingSize = std::max(ring->sqRingSize, ring->cqRingSize);
+	}
+	ring->sqRing = mmap(nullptr, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sqRing == MAP_FAILED) {
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cqRing = ring->sqRing;
+	} else {
+		ring->cqRing = mmap(nullptr, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring->cqRing == MAP_FAILED) {
+			goto fail;
+		}
+	}
+	ring->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *)mmap(nullptr, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		goto fail;
+	}
+
+	ring->sqHead = (unsigned *)((char *)ring->sqRing + p.sq_off.head);
+	ring->sqTail = (unsigned *)((char *)ring->sqRing + p.sq_off.tail);
+	ring->sqMask = *(unsigned *)((char *)ring->sqRing + p.sq_off.ring_mask);
+	ring->sqArray = (unsigned *)((char *)ring->sqRing + p.sq_off.array);
+	ring->cqHead = (unsigned *)((char *)ring->cqRing + p.cq_off.head);
+	ring->cqTail = (unsigned *)((char *)ring->cqRing + p.cq_off.tail);
+	ring->cqMask = *(unsigned *)((char *)ring->cqRing + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cqRing + p.cq_off.cqes);
+
+	{
+		std::lock_guard<std::mutex> lock(uringTableLock);
+		uringTable[fd] = ring;
+	}
+	return fd;
+
+fail:
+	uring_unmap(ring);
+	delete ring;
+	close(fd);
+	return -1;
+}
+
+void sp_release(int efd)
+{
+	sp_uring *ring;
+	{
+		std::lock_guard<std::mutex> lock(uringTableLock);
+		ring = uring_get(efd);
+		if (ring == nullptr) {
+			return;
+		}
+		uringTable[efd] = nullptr;
+	}
+	uring_unmap(ring);
+	close(ring->fd);
+	delete ring;
+}
+
+void sp_del(int efd, int sock)
+{
+	sp_uring *ring = uring_get(efd);
+	if (ring == nullptr || sock < 0 || static_cast<size_t>(sock) >= ring->slots.size()) {
+		return;
+	}
+	sp_uring_slot &slot = ring->slots[sock];
+	if (!slot.active) {
+		return;
+	}
+	uring_poll_remove(ring, sock, slot);
+	slot.active = false;
+	slot.ud = nullptr;
+	slot.gen = (slot.gen + 1) & URING_GEN_MASK;
+}
+
+int sp_add(int efd, int sock, void *ud)
+{
+	return uring_add(efd, sock, ud, POLLIN | POLLOUT);
+}
+
+int sp_add_read(int efd, int sock, void *ud)
+{
+	return uring_add(efd, sock, ud, POLLIN);
+}
+
+int sp_add_write(int efd, int sock, void *ud)
+{
+	return uring_add(efd, sock, ud, POLLIN | POLLOUT);
+}
+
+static int uring_set_write(int efd, int sock, void *ud, bool enable)
+{
+	sp_uring *ring = uring_get(efd);
+	if (ring == nullptr || sock < 0 || static_cast<size_t>(sock) >= ring->slots.size()) {
+		errno = EBADF;
+		return -1;
+	}
+	sp_uring_slot &slot = ring->slots[sock];
+	if (!slot.active) {
+		errno = ENOENT;
+		return -1;
+	}
+	slot.ud = ud;
+	slot.mask = enable ? (POLLIN | POLLOUT) : POLLIN;
+	// a multishot poll already covers both directions; an unarmed slot
+	// picks the new mask up when it is re-armed
+	if (!slot.armed || slot.multi || slot.armedMask == uring_arm_mask(ring, slot)) {
+		return 0;
+	}
+	if (uring_poll_remove(ring, sock, slot) < 0) {
+		return -1;
+	}
+	slot.gen = (slot.gen + 1) & URING_GEN_MASK;
+	uring_schedule_arm(ring, sock, slot);
+	return 0;
+}
+
+int sp_enable_write(int efd, int sock, void *ud)
+{
+	return uring_set_write(efd, sock, ud, true);
+}
+
+int sp_disable_write(int efd, int sock, void *ud)
+{
+	return uring_set_write(efd, sock, ud, false);
+}
+
+int sp_wait(int efd, struct event *e, int max, const timespec *timeout)
+{
+	sp_uring *ring = uring_get(efd);
+	if (ring == nullptr) {
+		errno = EBADF;
+		return -1;
+	}
+
+	for (auto sock: ring->rearm) {
+		sp_uring_slot &slot = ring->slots[sock];
+		slot.queued = false;
+		if (!slot.active || slot.armed) {
+			continue;
+		}
+		struct io_uring_sqe *sqe = uring_get_sqe(ring);
+		if (sqe == nullptr) {
+			return -1;
+		}
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = sock;
+		slot.armedMask = uring_arm_mask(ring, slot);
+		slot.multi = ring->multishot;
+		sqe->poll32_events = slot.armedMask;
+		sqe->len = slot.multi ? IORING_POLL_ADD_MULTI : 0;
+		sqe->user_data = uring_user_data(sock, slot.gen);
+		slot.armed = true;
+	}
+	ring->rearm.clear();
+
+	unsigned head = *ring->cqHead;
+	bool ready = head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+	unsigned flags = 0;
+	unsigned minComplete = 0;
+	const void *arg = nullptr;
+	size_t argsz = 0;
+	struct io_uring_getevents_arg extArg;
+	if (!ready && max > 0) {
+		flags |= IORING_ENTER_GETEVENTS;
+		minComplete = 1;
+		if (timeout != nullptr) {
+			ring->ts.tv_sec = timeout->tv_sec;
+			ring->ts.tv_nsec = timeout->tv_nsec;
+			if (ring->features & IORING_FEAT_EXT_ARG) {
+				memset(&extArg, 0, sizeof(extArg));
+				extArg.ts = reinterpret_cast<uint64_t>(&ring->ts);
+				flags |= IORING_ENTER_EXT_ARG;
+				arg = &extArg;
+				argsz = sizeof(extArg);
+			} else if (!ring->timeoutPending) {
+				struct io_uring_sqe *sqe = uring_get_sqe(ring);
+				if (sqe != nullptr) {
+					sqe->opcode = IORING_OP_TIMEOUT;
+					sqe->fd = -1;
+					sqe->addr = reinterpret_cast<uint64_t>(&ring->ts);
+					sqe->len = 1;
+					sqe->user_data = URING_TAG_INTERNAL | 1;
+					ring->timeoutPending = true;
+				}
+			}
+		}
+	}
+	if (ring->sqPending > 0 || minComplete > 0) {
+		int n = io_uring_enter(ring->fd, ring->sqPending, minComplete, flags, arg, argsz);
+		if (n < 0) {
+			if (errno != EINTR && errno != ETIME) {
+				return -1;
+			}
+		} else {
+			ring->sqPending -= n;
+		}
+	}
+
+	int count = 0;
+	head = *ring->cqHead;
+	unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+	while (head != tail && count < max) {
+		const struct io_uring_cqe &cqe = ring->cqes[head & ring->cqMask];
+		head++;
+		if (cqe.user_data & URING_TAG_INTERNAL) {
+			if (cqe.user_data == (URING_TAG_INTERNAL | 1)) {
+				ring->timeoutPending = false;
+			}
+			continue;
+		}
+		int sock = static_cast<int>(cqe.user_data & 0xffffffff);
+		uint32_t gen = static_cast<uint32_t>(cqe.user_data >> 32);
+		if (static_cast<size_t>(sock) >= ring->slots.size()) {
+			continue;
+		}
+		sp_uring_slot &slot = ring->slots[sock];
+		if (!slot.active || slot.gen != gen) {
+			// completion of a poll that was removed or replaced
+			continue;
+		}
+		bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+		if (!more) {
+			slot.armed = false;
+		}
+		if (cqe.res == -ECANCELED) {
+			uring_schedule_arm(ring, sock, slot);
+			continue;
+		}
+		if (cqe.res == -EINVAL && slot.multi) {
+			// kernel older than 5.13: every poll armed multishot comes back
+			// like this, poll one-shot from now on and re-arm each of them
+			ring->multishot = false;
+			uring_schedule_arm(ring, sock, slot);
+			continue;
+		}
+		uint32_t revents = cqe.res < 0 ? POLLERR : static_cast<uint32_t>(cqe.res);
+		e[count].ud = slot.ud;
+		e[count].write = (revents & POLLOUT) != 0;
+		e[count].read = (revents & (POLLIN | POLLHUP)) != 0;
+		e[count].error = (revents & POLLERR) != 0;
+		count++;
+		if (!more) {
+			uring_schedule_arm(ring, sock, slot);
+		}
+	}
+	__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+#endif
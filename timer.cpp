@@ -0,0 +1,135 @@
+#include "timer.h"
+
+#include <limits.h>
+#include <algorithm>
+
+TimerWheel::TimerWheel(uint32_t _tickMs, uint64_t nowMs): tickMs(_tickMs), count(0)
+{
+    currentTick = nowMs / tickMs;
+    for (auto level = 0; level < TIMER_LEVELS; ++level) {
+        for (auto i = 0; i < TIMER_SLOTS; ++i) {
+            TimerNode &head = slots[level][i];
+            head.prev = head.next = &head;
+        }
+    }
+}
+
+void TimerWheel::link(TimerNode *node)
+{
+    uint64_t expire = node->expire;
+    if (expire < currentTick) {
+        expire = currentTick;
+    }
+    uint64_t delta = expire - currentTick;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= (1ULL << ((level + 1) * TIMER_SLOT_BITS))) {
+        ++level;
+    }
+    uint64_t index;
+    if (delta >= (1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS))) {
+        // beyond the wheel range: park in the farthest slot, it will be
+        // cascaded again and eventually land where it belongs
+        index = (currentTick >> (level * TIMER_SLOT_BITS)) - 1;
+    } else {
+        index = expire >> (level * TIMER_SLOT_BITS);
+    }
+    TimerNode &head = slots[level][index & (TIMER_SLOTS - 1)];
+    node->next = &head;
+    node->prev = head.prev;
+    head.prev->next = node;
+    head.prev = node;
+}
+
+void TimerWheel::unlink(TimerNode *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+}
+
+void TimerWheel::add(TimerNode *node, uint64_t expireMs)
+{
+    if (node->linked()) {
+        unlink(node);
+    } else {
+        count++;
+    }
+    node->expire = (expireMs + tickMs - 1) / tickMs;
+    if (node->expire <= currentTick) {
+        // the current slot has already run
+        node->expire = currentTick + 1;
+    }
+    link(node);
+}
+
+void TimerWheel::remove(TimerNode *node)
+{
+    if (!node->linked()) {
+        return;
+    }
+    unlink(node);
+    count--;
+}
+
+void TimerWheel::cascade(int level)
+{
+    TimerNode &head = slots[level][(currentTick >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1)];
+    TimerNode *node = head.next;
+    head.prev = head.next = &head;
+    while (node != &head) {
+        TimerNode *next = node->next;
+        link(node);
+        node = next;
+    }
+}
+
+void TimerWheel::advance(uint64_t nowMs, std::vector<TimerNode *> &expired)
+{
+    uint64_t nowTick = nowMs / tickMs;
+    while (currentTick < nowTick) {
+        currentTick++;
+        // when a level wraps, pull the next slot of the level above down
+        for (auto level = 1; level < TIMER_LEVELS; ++level) {
+            if ((currentTick & ((1ULL << (level * TIMER_SLOT_BITS)) - 1)) != 0) {
+                break;
+            }
+            cascade(level);
+        }
+        TimerNode &head = slots[0][currentTick & (TIMER_SLOTS - 1)];
+        while (head.next != &head) {
+            TimerNode *node = head.next;
+            unlink(node);
+            count--;
+            expired.push_back(node);
+        }
+        if (count == 0) {
+            currentTick = nowTick;
+        }
+    }
+}
+
+int TimerWheel::nextTimeoutMs(uint64_t nowMs) const
+{
+    if (count == 0) {
+        return -1;
+    }
+    // level 0 fires its first occupied slot, a higher level needs a wakeup
+    // when its first occupied slot is cascaded down; the earliest wins
+    uint64_t nextTick = UINT64_MAX;
+    for (auto level = 0; level < TIMER_LEVELS; ++level) {
+        int shift = level * TIMER_SLOT_BITS;
+        uint64_t base = currentTick >> shift;
+        for (uint64_t i = 1; i <= TIMER_SLOTS; ++i) {
+            const TimerNode &head = slots[level][(base + i) & (TIMER_SLOTS - 1)];
+            if (head.next != &head) {
+                nextTick = std::min(nextTick, (base + i) << shift);
+                break;
+            }
+        }
+    }
+    uint64_t next = nextTick * tickMs;
+    if (next <= nowMs) {
+        return 0;
+    }
+    return static_cast<int>(std::min<uint64_t>(next - nowMs, INT_MAX));
+}
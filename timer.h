@@ -0,0 +1,76 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+static inline uint64_t monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Intrusive timer entry, embedded in the object it times out. A node is
+ * in at most one wheel slot at a time; prev is null while unlinked.
+ */
+struct TimerNode {
+    TimerNode(): prev(nullptr), next(nullptr), expire(0), ud(nullptr) {}
+    TimerNode(const TimerNode &other): prev(nullptr), next(nullptr), expire(other.expire), ud(other.ud) {}
+    TimerNode &operator=(const TimerNode &other) {
+        // linkage belongs to the wheel and is never copied
+        expire = other.expire;
+        ud = other.ud;
+        return *this;
+    }
+    bool linked() const {
+        return prev != nullptr;
+    }
+    TimerNode *prev;
+    TimerNode *next;
+    uint64_t expire;    // in ticks
+    void *ud;
+};
+
+/*
+ * Hierarchical timing wheel: TIMER_LEVELS levels of TIMER_SLOTS slots each,
+ * level n covering TIMER_SLOTS^(n+1) ticks. add and remove are O(1); a node
+ * further away is cascaded one level down each time the level below wraps.
+ */
+class TimerWheel
+{
+public:
+    static const int TIMER_SLOT_BITS = 6;
+    static const int TIMER_SLOTS = 1 << TIMER_SLOT_BITS;
+    static const int TIMER_LEVELS = 4;
+
+    TimerWheel(uint32_t tickMs, uint64_t nowMs);
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    // (re)schedule node to fire at expireMs, rounded up to a whole tick
+    void add(TimerNode *node, uint64_t expireMs);
+    void remove(TimerNode *node);
+    // run the wheel up to nowMs and collect the nodes that expired
+    void advance(uint64_t nowMs, std::vector<TimerNode *> &expired);
+    // time until the earliest tick that has work, or -1 when no timer is
+    // pending
+    int nextTimeoutMs(uint64_t nowMs) const;
+    size_t size() const {
+        return count;
+    }
+
+private:
+    void link(TimerNode *node);
+    static void unlink(TimerNode *node);
+    void cascade(int level);
+
+    uint32_t tickMs;
+    uint64_t currentTick;
+    size_t count;
+    TimerNode slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+#endif